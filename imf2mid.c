@@ -26,13 +26,32 @@
 #include "imf2mid.h"
 #include <memory.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <malloc.h>
 #include <math.h>
+#include <time.h>
+#include "regtable.h"
+
+/* Real-mode DOS has no room for large static buffers */
+#if defined(MSDOS) || defined(__MSDOS__) || defined(_MSDOS) || defined(__DOS__)
+#define ENABLE_SMALL_BUFFERS
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ENABLE_MMAP_INSTDB
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 
 #define  MIDI_PITCH_CENTER      0x2000
+#define  MIDI_PATCH_NONE        0xFF
+#define  MIDI_DRUM_CHANNEL      9
 #define  MIDI_CONTROLLER_VOLUME 7
 
 
@@ -41,13 +60,39 @@
  *****************************************************************/
 
 #define ENABLE_BUFFERIZED_WRITE
+#ifdef ENABLE_SMALL_BUFFERS
 #define BUF_MAX_SIZE  20480
+#else
+#define BUF_MAX_SIZE  262144
+#endif
 
+/*
+ * Seeks inside of the buffered data are only moving the cursor, so the
+ * back-patching of sizes doesn't flush the buffer, and the whole MIDI
+ * file which fits the buffer gets written by one call.
+ */
 #ifdef ENABLE_BUFFERIZED_WRITE
 static char    BUF_output[BUF_MAX_SIZE];
 static size_t  BUF_stored   = 0;
+static size_t  BUF_cursor   = 0;
 static size_t  BUF_lastPos  = 0;
 #endif
+/* Position of the MIDI file in the output, non-zero when writing into an archive */
+static long    BUF_base     = 0;
+/* Drops everything written, while skipping the part of the song before the range */
+static int     BUF_mute     = 0;
+
+/* Starts writing of the new file at given position of the output */
+static void fbeginb(FILE* output, long base)
+{
+    fseek(output, base, SEEK_SET);
+    BUF_base = base;
+    #ifdef ENABLE_BUFFERIZED_WRITE
+    BUF_lastPos = (size_t)base;
+    BUF_stored = 0;
+    BUF_cursor = 0;
+    #endif
+}
 
 static void fflushb(FILE* output)
 {
@@ -55,8 +100,11 @@ static void fflushb(FILE* output)
     if(BUF_stored == 0)
         return;
     fwrite(BUF_output, 1, BUF_stored, output);
-    BUF_lastPos += BUF_stored;
+    if(BUF_cursor != BUF_stored) /* Continue writing from the cursor */
+        fseek(output, (long)(BUF_lastPos + BUF_cursor), SEEK_SET);
+    BUF_lastPos += BUF_cursor;
     BUF_stored = 0;
+    BUF_cursor = 0;
     #else
     fflush(output);
     #endif
@@ -64,7 +112,13 @@ static void fflushb(FILE* output)
 
 static void fseekb(FILE*f, long b)
 {
+    b += BUF_base;
     #ifdef ENABLE_BUFFERIZED_WRITE
+    if(((size_t)b >= BUF_lastPos) && ((size_t)b <= BUF_lastPos + BUF_stored))
+    {
+        BUF_cursor = (size_t)b - BUF_lastPos;
+        return;
+    }
     fflushb(f);
     #endif
     fseek(f, b, SEEK_SET);
@@ -77,9 +131,9 @@ static long ftellb(FILE* file)
 {
     #ifdef ENABLE_BUFFERIZED_WRITE
     (void)file;
-    return (long)(BUF_lastPos + BUF_stored);
+    return (long)(BUF_lastPos + BUF_cursor) - BUF_base;
     #else
-    return ftell(file);
+    return ftell(file) - BUF_base;
     #endif
 }
 
@@ -87,17 +141,23 @@ static size_t fwriteb(char* buf, size_t elements, size_t size, FILE* output)
 {
     #ifdef ENABLE_BUFFERIZED_WRITE
     size_t newSize = elements * size;
-    if(BUF_MAX_SIZE < (BUF_stored + newSize))
+    if(BUF_mute)
+        return size;
+    if(BUF_MAX_SIZE < (BUF_cursor + newSize))
     {
         fflushb(output);
         newSize = size;
     }
 
-    memcpy(BUF_output + BUF_stored, buf, newSize);
+    memcpy(BUF_output + BUF_cursor, buf, newSize);
 
-    BUF_stored += newSize;
+    BUF_cursor += newSize;
+    if(BUF_cursor > BUF_stored)
+        BUF_stored = BUF_cursor;
     return size;
     #else
+    if(BUF_mute)
+        return size;
     return fwrite(buf, elements, size, output);
     #endif
 }
@@ -105,6 +165,211 @@ static size_t fwriteb(char* buf, size_t elements, size_t size, FILE* output)
 /*****************************************************************/
 
 
+/*****************************************************************
+ *                            Logging                            *
+ *****************************************************************/
+
+/*
+ * Errors and warnings are going into stderr, everything else is going
+ * into the stdout which is flushed at the end of every conversion.
+ */
+static int         LOG_level = IMF2MID_LOG_DEBUG;
+static const char *LOG_prefix = NULL;
+
+static void logSetLevel(int level)
+{
+    LOG_level = (level > IMF2MID_LOG_WARN) ? level : IMF2MID_LOG_WARN;
+}
+
+/* Every line of the message must be logged by its own call to get the prefix */
+static void logMessage(int level, const char *fmt, ...)
+{
+    va_list args;
+    FILE   *out = stdout;
+
+    if(level > LOG_level)
+        return;
+
+    if(level <= IMF2MID_LOG_WARN)
+    {
+        /* Keep the order of messages while stdout is buffered */
+        fflush(stdout);
+        out = stderr;
+    }
+
+    if(LOG_prefix)
+        fprintf(out, "[%s] ", LOG_prefix);
+
+    if(level == IMF2MID_LOG_ERROR)
+        fputs("\x1b[31mERROR:\x1b[0m ", out);
+    else if(level == IMF2MID_LOG_WARN)
+        fputs("\x1b[31mWARNING:\x1b[0m ", out);
+
+    va_start(args, fmt);
+    vfprintf(out, fmt, args);
+    va_end(args);
+}
+/*****************************************************************/
+
+
+/*****************************************************************
+ *                 Bufferized input and pre-scan                 *
+ *****************************************************************/
+
+/* Count of IMF records (4 bytes each) read from the file per one call */
+#ifdef ENABLE_SMALL_BUFFERS
+#define IMF_BLOCK_RECORDS   512
+#else
+#define IMF_BLOCK_RECORDS   16384
+#endif
+
+/* Register write classes used by the pre-scan */
+#define IMF_REG_IGNORED     0 /* Converter doesn't use this register */
+#define IMF_REG_OVERWRITE   1 /* Only the last write before a delay matters */
+#define IMF_REG_ORDERED     2 /* Every write matters (key-on and levels) */
+
+static uint8_t  IMF_block[IMF_BLOCK_RECORDS * 4];
+/* Index of every record remaining after the pre-scan in the block as it was read */
+static uint16_t IMF_blockOrigin[IMF_BLOCK_RECORDS];
+static uint8_t  IMF_regClass[256];
+static int      IMF_regClassReady = 0;
+static uint16_t IMF_regBurst[256];
+static uint16_t IMF_burst = 0;
+
+static void IMF_initRegClass(void)
+{
+    int reg;
+
+    for(reg = 0; reg < 256; reg++)
+    {
+        uint8_t cls = IMF_REG_IGNORED;
+
+        if( ((reg >= 0x20) && (reg <= 0x35)) ||
+            ((reg >= 0x60) && (reg <= 0x75)) ||
+            ((reg >= 0x80) && (reg <= 0x95)) ||
+            ((reg >= 0xA0) && (reg <= 0xA8)) ||
+            ((reg >= 0xC0) && (reg <= 0xC8)) ||
+            ((reg >= 0xE0) && (reg <= 0xF5)) )
+            cls = IMF_REG_OVERWRITE;
+        else
+        if( ((reg >= 0x40) && (reg <= 0x55)) ||
+            ((reg >= 0xB0) && (reg <= 0xB8)) )
+            cls = IMF_REG_ORDERED;
+
+        IMF_regClass[reg] = cls;
+    }
+
+    IMF_regClassReady = 1;
+}
+
+/**
+ * @brief Reads next block of IMF records
+ * @param f file to read
+ * @param recs buffer to store records
+ * @param length remaining length of IMF data in bytes, will be decreased
+ * @param eof set to 1 when file has been ended before the IMF length
+ * @return count of read records
+ */
+static size_t IMF_readBlock(FILE* f, uint8_t *recs, uint32_t *length, int *eof)
+{
+    size_t want = IMF_BLOCK_RECORDS;
+    size_t got;
+
+    if(((*length % 4) == 0) && ((*length / 4) < want))
+        want = (size_t)(*length / 4);
+
+    got = fread(recs, 4, want, f);
+    *length -= (uint32_t)(got * 4);
+
+    if(got < want)
+        *eof = 1;
+
+    return got;
+}
+
+/**
+ * @brief Drops records of the block which can't change the output
+ * @param recs block of IMF records
+ * @param count count of records in the block
+ * @return count of records remaining in the block
+ *
+ * Zero-delay writes into unused registers are dropped. Within a burst of
+ * zero-delay writes an earlier write is dropped when the same register is
+ * written again later in the same burst. Key-on and level registers are
+ * never coalesced as their handling depends on the previous state.
+ * The last record of the block is always kept.
+ */
+static size_t IMF_prescanBlock(uint8_t *recs, size_t count)
+{
+    size_t  i, j;
+    int     nextIsLevel = 0;
+    uint8_t *r;
+
+    if(!IMF_regClassReady)
+        IMF_initRegClass();
+
+    /* Pass 1: going backward, turn superseded writes into no-ops */
+    if(++IMF_burst == 0)
+    {
+        memset(IMF_regBurst, 0, sizeof(IMF_regBurst));
+        IMF_burst = 1;
+    }
+
+    for(i = count; i-- > 0; )
+    {
+        uint8_t reg, cls;
+        int     noDelay;
+
+        r       = recs + (i * 4);
+        reg     = r[2];
+        cls     = IMF_regClass[reg];
+        noDelay = (r[0] == 0) && (r[1] == 0);
+
+        if(cls != IMF_REG_IGNORED)
+        {
+            /*
+             * The level register handler reads the channel of the previous
+             * write, so the write right before it must stay in place
+             */
+            if(noDelay && (cls == IMF_REG_OVERWRITE) && !nextIsLevel &&
+               (IMF_regBurst[reg] == IMF_burst))
+                r[2] = 0x00;
+
+            IMF_regBurst[reg] = IMF_burst;
+            nextIsLevel = (reg >= 0x40) && (reg <= 0x55);
+        }
+
+        /*
+         * A record with delay begins the burst. The last record may be
+         * the last one of the song which is applied after the final flush.
+         */
+        if((!noDelay || ((i + 1) == count)) && (++IMF_burst == 0))
+        {
+            memset(IMF_regBurst, 0, sizeof(IMF_regBurst));
+            IMF_burst = 1;
+        }
+    }
+
+    /* Pass 2: drop zero-delay no-op records */
+    for(i = 0, j = 0; i < count; i++)
+    {
+        r = recs + (i * 4);
+
+        if(((i + 1) < count) && (r[0] == 0) && (r[1] == 0) &&
+           (IMF_regClass[r[2]] == IMF_REG_IGNORED))
+            continue;
+
+        if(i != j)
+            memcpy(recs + (j * 4), r, 4);
+        IMF_blockOrigin[j] = (uint16_t)i;
+        j++;
+    }
+
+    return j;
+}
+/*****************************************************************/
+
+
 /*****************************************************************
  *             Parsing endian-specific integers                  *
  *****************************************************************/
@@ -137,6 +402,12 @@ static uint32_t readLE32(FILE* f)
     out |= ((uint32_t)bytes[3]<<24) & 0xFF000000;
     return out;
 }
+
+static uint32_t readLE32buf(const uint8_t *b)
+{
+    return (uint32_t)b[0] | ((uint32_t)b[1] << 8) |
+           ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
 /*****************************************************************/
 
 
@@ -173,7 +444,6 @@ static int writeBE24(FILE* f, uint32_t in)
     return (int)fwriteb((char*)bytes, 1, 3, f);
 }
 
-#if 0
 static int writeLE32(FILE* f, uint32_t in)
 {
     uint8_t bytes[4];
@@ -183,7 +453,6 @@ static int writeLE32(FILE* f, uint32_t in)
     bytes[3] = (in>>24) & 0xFF;
     return (int)fwriteb((char*)bytes, 1, 4, f);
 }
-#endif
 
 static int writeBE32(FILE* f, uint32_t in)
 {
@@ -266,12 +535,197 @@ static void MIDI_writeEventCode(FILE*f,
     cvt->midi_eventCode = eventCode;
 }
 
+/*
+ * Optimized output keeps channel events of the current tick in the queue
+ * and writes them together when the time goes on. Events which change
+ * nothing are dropped: note-offs of keys which don't sound, and pitch
+ * bends or controllers changed again later in the same tick before any
+ * note of the channel. Events are written grouped by channels, with
+ * note-offs as note-ons of zero velocity, so the running status leaves
+ * out more status bytes. Changes which come before the first new note of
+ * the channel are written first, but pitch bends and controllers never
+ * go before note-offs, so releasing notes keep their sound.
+ */
+#define MIDI_QUEUE_SIZE 128
+
+struct MidiEvent
+{
+    uint8_t code;
+    uint8_t data[2];
+    uint8_t size;
+};
+
+static struct MidiEvent MIDI_queue[MIDI_QUEUE_SIZE];
+static size_t           MIDI_queueCount = 0;
+static uint32_t         MIDI_queueDelta = 0;
+
+#define MIDI_isNoteOn(e)  ((((e)->code & 0xF0) == 0x90) && ((e)->data[1] != 0))
+#define MIDI_isNoteOff(e) ((((e)->code & 0xF0) == 0x80) || ((((e)->code & 0xF0) == 0x90) && ((e)->data[1] == 0)))
+
+/* Checks that the event gets replaced by the later one of the same tick */
+static int MIDI_isSuperseded(size_t i)
+{
+    struct MidiEvent *e = &MIDI_queue[i];
+    uint8_t type = e->code & 0xF0;
+    size_t  j;
+
+    if((type != 0xE0) && (type != 0xB0))
+        return 0;
+
+    for(j = i + 1; j < MIDI_queueCount; j++)
+    {
+        struct MidiEvent *n = &MIDI_queue[j];
+        if(n->code != e->code)
+        {
+            /* Every note starts or gets released with the pitch and controllers set before it */
+            if(((n->code & 0x0F) == (e->code & 0x0F)) && (MIDI_isNoteOn(n) || MIDI_isNoteOff(n)))
+                return 0;
+            continue;
+        }
+        if((type == 0xE0) || (n->data[0] == e->data[0]))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Writes events of the queue, called before the time goes on */
+static void MIDI_flushEvents(FILE *f, struct Imf2MIDI_CVT *cvt)
+{
+    uint8_t  keep[MIDI_QUEUE_SIZE];
+    uint8_t  written[MIDI_QUEUE_SIZE];
+    uint16_t channels = 0;
+    int      first, ch, pass, released;
+    size_t   i;
+
+    if(MIDI_queueCount == 0)
+        return;
+
+    for(i = 0; i < MIDI_queueCount; i++)
+    {
+        struct MidiEvent *e = &MIDI_queue[i];
+        uint8_t *keys = cvt->midi_keysOn + ((e->code & 0x0F) * 16);
+        uint8_t  bit = (uint8_t)(1 << (e->data[0] & 7));
+
+        keep[i] = !MIDI_isSuperseded(i);
+        written[i] = 0;
+        channels |= (uint16_t)(1 << (e->code & 0x0F));
+
+        /* Data bytes out of range can't be played and would break the running status */
+        if((e->data[0] | e->data[1]) & 0x80)
+            keep[i] = 0;
+        else if(MIDI_isNoteOn(e))
+            keys[(e->data[0] & 0x7F) >> 3] |= bit;
+        else if(MIDI_isNoteOff(e))
+        {
+            if(!(keys[(e->data[0] & 0x7F) >> 3] & bit))
+                keep[i] = 0;
+            keys[(e->data[0] & 0x7F) >> 3] &= (uint8_t)~bit;
+        }
+    }
+
+    /* Channel of the running status goes first */
+    first = -1;
+    if((cvt->midi_eventCode >= 0) && ((cvt->midi_eventCode & 0xF0) == 0x90) &&
+       (channels & (1 << (cvt->midi_eventCode & 0x0F))))
+        first = cvt->midi_eventCode & 0x0F;
+
+    for(ch = -1; ch < 16; ch++)
+    {
+        int c = (ch < 0) ? first : ch;
+
+        if((c < 0) || ((ch >= 0) && (ch == first)) || !(channels & (1 << c)))
+            continue;
+
+        /* Changes before the first new note of the channel, then everything else */
+        for(pass = 0; pass < 2; pass++)
+        {
+            released = 0;
+            for(i = 0; i < MIDI_queueCount; i++)
+            {
+                struct MidiEvent *e = &MIDI_queue[i];
+                uint8_t code = e->code;
+
+                if(((code & 0x0F) != c) || written[i])
+                    continue;
+                if(pass == 0)
+                {
+                    if(MIDI_isNoteOn(e))
+                        break;
+                    if(MIDI_isNoteOff(e))
+                    {
+                        released = 1;
+                        continue;
+                    }
+                    /* Only patch changes don't affect releasing notes */
+                    if(released && ((code & 0xF0) != 0xC0))
+                        continue;
+                }
+
+                written[i] = 1;
+                if(!keep[i])
+                    continue;
+
+                if(MIDI_isNoteOff(e) && (e->data[1] == 0))
+                    code = (uint8_t)(0x90 | (code & 0x0F));
+
+                writeVarLen32(f, MIDI_queueDelta);
+                MIDI_queueDelta = 0;
+                MIDI_writeEventCode(f, cvt, code);
+                fwriteb((char*)e->data, 1, e->size, f);
+            }
+        }
+    }
+
+    /* Time of dropped events goes to the next one */
+    cvt->midi_delta += MIDI_queueDelta;
+    MIDI_queueDelta = 0;
+    MIDI_queueCount = 0;
+    cvt->midi_fileSize = (uint32_t)ftellb(f);
+}
+
+/* Writes the channel event, or keeps it in the queue for optimized output */
+static void MIDI_putEvent(FILE *f, struct Imf2MIDI_CVT *cvt,
+                          uint8_t code, uint8_t data1, uint8_t data2, uint8_t size)
+{
+    struct MidiEvent *e;
+
+    if(!cvt->flag_optimize)
+    {
+        writeVarLen32(f, cvt->midi_delta);
+        cvt->midi_delta = 0;
+
+        MIDI_writeEventCode(f, cvt, code);
+        write8(f, data1);
+        if(size > 1)
+            write8(f, data2);
+        cvt->midi_fileSize = (uint32_t)ftellb(f);
+        return;
+    }
+
+    if((MIDI_queueCount > 0) && ((cvt->midi_delta > 0) || (MIDI_queueCount >= MIDI_QUEUE_SIZE)))
+        MIDI_flushEvents(f, cvt);
+
+    if(MIDI_queueCount == 0)
+    {
+        MIDI_queueDelta = cvt->midi_delta;
+        cvt->midi_delta = 0;
+    }
+
+    e = &MIDI_queue[MIDI_queueCount++];
+    e->code = code;
+    e->data[0] = data1;
+    e->data[1] = data2;
+    e->size = size;
+}
+
 static void MIDI_writeMetaEvent(FILE*f,
                                 struct Imf2MIDI_CVT *cvt,
                                 uint8_t type,
                                 int8_t  *bytes,
                                 uint32_t size)
 {
+    MIDI_flushEvents(f, cvt);
     writeVarLen32(f, cvt->midi_delta);
     cvt->midi_delta = 0;
 
@@ -288,14 +742,8 @@ static void MIDI_writeControlEvent(FILE*f,
                                    uint8_t controller,
                                    uint8_t value)
 {
-    writeVarLen32(f, cvt->midi_delta);
-    cvt->midi_delta = 0;
-
     channel = channel % 16;
-    MIDI_writeEventCode(f, cvt, 0xB0 + channel);
-    write8(f, controller);
-    write8(f, value);
-    cvt->midi_fileSize = (uint32_t)ftellb(f);
+    MIDI_putEvent(f, cvt, 0xB0 + channel, controller, value, 2);
 }
 
 static void MIDI_writePatchChangeEvent(FILE* f,
@@ -303,13 +751,10 @@ static void MIDI_writePatchChangeEvent(FILE* f,
                                        uint8_t channel,
                                        uint8_t patch)
 {
-    writeVarLen32(f, cvt->midi_delta);
-    cvt->midi_delta = 0;
-
     channel = channel % 16;
-    MIDI_writeEventCode(f, cvt, 0xC0 + channel);
-    write8(f, patch);
-    cvt->midi_fileSize = (uint32_t)ftellb(f);
+    MIDI_putEvent(f, cvt, 0xC0 + channel, patch, 0, 1);
+    /* Remember patch to restore it at the begin of the range */
+    cvt->midi_lastpatch[channel] = patch;
 }
 
 static void MIDI_writePitchEvent(FILE*f,
@@ -317,19 +762,12 @@ static void MIDI_writePitchEvent(FILE*f,
                                  uint8_t    channel,
                                  uint16_t   value)
 {
-    channel = channel % 9;
+    channel = channel % IMF2MID_MIDI_CHANNELS;
 
     if(cvt->midi_lastpitch[channel] == value)
         return;/* Don't write pitch if value is same */
 
-    writeVarLen32(f, cvt->midi_delta);
-    cvt->midi_delta = 0;
-
-
-    MIDI_writeEventCode(f, cvt, 0xE0 + channel);
-    write8(f,  value & 0x7F);
-    write8(f, (value>>7) & 0x7F);
-    cvt->midi_fileSize = (uint32_t)ftellb(f);
+    MIDI_putEvent(f, cvt, 0xE0 + channel, value & 0x7F, (value>>7) & 0x7F, 2);
     /* Remember pitch value to don't repeat */
     cvt->midi_lastpitch[channel] = value;
 }
@@ -340,14 +778,8 @@ static void MIDI_writeNoteOnEvent(FILE*f,
                                  uint8_t    key,
                                  uint8_t    velocity)
 {
-    writeVarLen32(f, cvt->midi_delta);
-    cvt->midi_delta = 0;
-
     channel = channel % 16;
-    MIDI_writeEventCode(f, cvt, 0x90 + channel);
-    write8(f,  key);
-    write8(f,  velocity);
-    cvt->midi_fileSize = (uint32_t)ftellb(f);
+    MIDI_putEvent(f, cvt, 0x90 + channel, key, velocity, 2);
 }
 
 static void MIDI_writeNoteOffEvent(FILE*f,
@@ -356,24 +788,20 @@ static void MIDI_writeNoteOffEvent(FILE*f,
                                    uint8_t   key,
                                    uint8_t   velocity)
 {
-    uint8_t code = ((velocity != 0) ||
+    /* Status of queued event gets chosen when it's written */
+    uint8_t code = ((velocity != 0) || cvt->flag_optimize ||
                    (cvt->midi_eventCode < 0) ||
                   ((cvt->midi_eventCode & 0xF0) != 0x90)) ? 0x80 : 0x90;
     channel = channel % 16;
 
-    writeVarLen32(f, cvt->midi_delta);
-    cvt->midi_delta = 0;
-
-    MIDI_writeEventCode(f, cvt, code + channel);
-    write8(f,  key);
-    write8(f,  velocity);
-    cvt->midi_fileSize = (uint32_t)ftellb(f);
+    MIDI_putEvent(f, cvt, code + channel, key, velocity, 2);
 }
 
 static void MIDI_writeTempoEvent(FILE*f,
                                 struct Imf2MIDI_CVT *cvt,
                                 uint32_t ticks)
 {
+    MIDI_flushEvents(f, cvt);
     writeVarLen32(f, cvt->midi_delta);
     cvt->midi_delta = 0;
 
@@ -393,6 +821,7 @@ static void MIDI_writeMetricKeyEvent(FILE*f,
 {
     uint8_t denomID = (uint8_t)(log((double)denom) / log(2.0));
 
+    MIDI_flushEvents(f, cvt);
     writeVarLen32(f, cvt->midi_delta);
     cvt->midi_delta = 0;
 
@@ -502,7 +931,20 @@ static uint8_t opl2_op[] =
 /*****************************************************************
  *                     Frequency management                      *
  *****************************************************************/
-static int8_t nearestFreq(uint16_t hz)
+/*
+ * Note and pitch of an F-number are needed for all 9 channels on every
+ * delay, so they are computed once for every possible 10-bit F-number.
+ */
+#define FREQ_COUNT      1024
+#define FREQ_PITCH_KEEP 0xFFFF
+
+static int8_t   FREQ_nearest[FREQ_COUNT];
+static uint16_t FREQ_pitch[FREQ_COUNT];
+static int      FREQ_ready = 0;
+
+static void freqInitTables(void);
+
+static int8_t nearestFreqCalc(uint16_t hz)
 {
     int8_t      nearestIndex    = -1;
     uint16_t    nearestDistance = 0;
@@ -521,6 +963,15 @@ static int8_t nearestFreq(uint16_t hz)
     return nearestIndex;
 }
 
+static int8_t nearestFreq(uint16_t hz)
+{
+    if(hz >= FREQ_COUNT)
+        return nearestFreqCalc(hz);
+    if(!FREQ_ready)
+        freqInitTables();
+    return FREQ_nearest[hz];
+}
+
 static int16_t relativeFreq(int16_t i, int16_t halfNotes)
 {
     int16_t direction = (halfNotes > 0) ? 1 : -1;
@@ -534,7 +985,7 @@ static int16_t relativeFreq(int16_t i, int16_t halfNotes)
         i         += direction;
     }
 
-    if(halfNotes == 0)
+    if((halfNotes == 0) && (i >= 0))
         return (int16_t)note_frequencies[i];
 
     return -1;
@@ -704,12 +1155,14 @@ static void *delete_hash(jwHashTable *table)
     for(; i < table->buckets; i++)
     {
         jwHashEntry *entry = table->bucket[i];
-        if(entry != 0)
+        while(entry != 0)
         {
+            jwHashEntry *next = entry->next;
             /* delete string value if needed */
             if(entry->key.strValue)
                 free(entry->key.strValue);
             free(entry);
+            entry = next;
         }
     }
 
@@ -739,7 +1192,7 @@ static HASHRESULT add_int_by_str( jwHashTable *table, char *key, long int value
         /* check for replacing entry */
         if(0 == strcmp(entry->key.strValue, key) && (value != entry->value.intValue))
         {
-            entry->value.intValue = (int)value;
+            entry->value.intValue = value;
             return HASHREPLACEDVALUE;
         }
 
@@ -751,7 +1204,7 @@ static HASHRESULT add_int_by_str( jwHashTable *table, char *key, long int value
     entry = (jwHashEntry *)malloc(sizeof(jwHashEntry));
     entry->key.strValue = copystring(key);
     entry->valtag = HASHNUMERIC;
-    entry->value.intValue = (int)value;
+    entry->value.intValue = value;
     entry->next = table->bucket[hash];
     table->bucket[hash] = entry;
 
@@ -784,6 +1237,25 @@ static HASHRESULT get_int_by_str( jwHashTable *table, char *key, int *i )
     /* not found */
     return HASHNOTFOUND;
 }
+
+/* Lookup long - keyed by str */
+static HASHRESULT get_long_by_str( jwHashTable *table, char *key, long *l )
+{
+    unsigned long hash = hashString(key) % table->buckets;
+    jwHashEntry *entry = table->bucket[hash];
+
+    while(entry)
+    {
+        if(0 == strcmp(entry->key.strValue, key))
+        {
+            *l = entry->value.intValue;
+            return HASHOK;
+        }
+        entry = entry->next;
+    }
+
+    return HASHNOTFOUND;
+}
 /*****************************************************************/
 
 
@@ -884,152 +1356,3578 @@ static jwHashTable* loadInstMap(void)
     return table;
 }
 
-static uint8_t detectPatch(jwHashTable*table, struct AdLibInstrument *inst, int log)
+#define INST_FP_SIZE    11
+
+/* Packs the fingerprint of instrument used by the detection tables */
+static void instFingerprint(struct AdLibInstrument *inst, uint8_t *fp)
 {
-    char instBuff[27];
-    int val = 0;
+    fp[0]  = inst->reg20[0];
+    fp[1]  = inst->reg20[1];
+    fp[2]  = inst->reg40[0] & 0xC0;
+    fp[3]  = inst->reg40[1];
+    fp[4]  = inst->reg60[0];
+    fp[5]  = inst->reg60[1];
+    fp[6]  = inst->reg60[0];
+    fp[7]  = inst->reg60[1];
+    fp[8]  = inst->regC0;
+    fp[9]  = inst->regE0[0];
+    fp[10] = inst->regE0[1];
+}
 
-    sprintf(instBuff,
-           "%02X%02X"
-           "%02X%02X"
-           "%02X%02X"
-           "%02X%02X"
-           "%02X"
-           "%02X%02X"
-           ,
-            inst->reg20[0], inst->reg20[1],
-           (inst->reg40[0] & 0xC0), inst->reg40[1],
-            inst->reg60[0], inst->reg60[1],
-            inst->reg60[0], inst->reg60[1],
-            inst->regC0,
-            inst->regE0[0], inst->regE0[1]
-           );
-
-    if(get_int_by_str(table, instBuff, &val) == HASHOK)
-    {
-        if(log)
-            printf("Detected instrument %03d\n", val);
-        return (uint8_t)(val % 128);
-    } else {
-        val = rand() % 128;
-        if(log)
-            printf("INSTRUMENT NOT FOUND, USING RANDOM %03d\n", val);
+/* Must match the regHash() in tools/regconv.c */
+static uint32_t instHash(const uint8_t *fp, uint32_t seed)
+{
+    uint32_t h = 2166136261UL ^ seed;
+    size_t   i;
+
+    for(i = 0; i < INST_FP_SIZE; i++)
+    {
+        h ^= fp[i];
+        h *= 16777619UL;
     }
 
-    return rand() % 128;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6DUL;
+    h ^= h >> 12;
+    return h;
 }
 
-static void printInst(struct AdLibInstrument *inst, uint8_t channel, int log, FILE* inst_log)
+/**
+ * @brief Looks up the built-in instrument table generated from regtable.txt
+ * @param fp fingerprint of instrument
+ * @param patch found patch
+ * @return 1 if instrument was found, 0 if not
+ */
+static int builtinFindPatch(const uint8_t *fp, int *patch)
 {
-    if(inst_log)
+#if REGTABLE_COUNT > 0
+    uint32_t d = regtable_disp[instHash(fp, 0) % REGTABLE_BUCKETS];
+    uint32_t s;
+
+    if(d & REGTABLE_DIRECT)
+        s = d & ~REGTABLE_DIRECT;
+    else
+        s = instHash(fp, d) % REGTABLE_COUNT;
+
+    if(memcmp(regtable_keys[s], fp, INST_FP_SIZE) == 0)
     {
-        fprintf(inst_log,
-               "%02X%02X"
-               "%02X%02X"
-               "%02X%02X"
-               "%02X%02X"
-               "%02X"
-               "%02X%02X|%03d\n"
-               ,
-                inst->reg20[0], inst->reg20[1],
-               (inst->reg40[0] & 0xC0), inst->reg40[1],
-                inst->reg60[0], inst->reg60[1],
-                inst->reg60[0], inst->reg60[1],
-                inst->regC0,
-                inst->regE0[0], inst->regE0[1],
-                (int)channel
-               );
+        *patch = (int)regtable_patch[s];
+        return 1;
     }
+#else
+    (void)fp;
+    (void)patch;
+#endif
+    return 0;
+}
 
-    if(log)
-    {
-        printf("%d) "
-               "20:[%02X %02X]; "
-               "40:[%02X %02X]; "
-               "60:[%02X %02X]; "
-               "80:[%02X %02X]; "
-               "C0:[%02X]; "
-               "E0:[%02X %02X]\n"
-               ,
-                (int)channel,
-                inst->reg20[0], inst->reg20[1],
-               (inst->reg40[0] & 0xC0), inst->reg40[1],
-                inst->reg60[0], inst->reg60[1],
+/*****************************************************************/
+
+
+/*****************************************************************
+ *                 Binary instrument database                    *
+ *****************************************************************/
+
+/*
+ * Format of the regtable.bin (all integers are little-endian):
+ *   char[4]          magic "I2MT"
+ *   uint16           format version
+ *   uint16           size of fingerprint (11)
+ *   uint32           count of instruments
+ *   uint8[count][11] fingerprints, sorted in ascending order
+ *   uint8[count]     patches
+ * The file is created by tools/regconv from a regtable.txt and is
+ * searched in place, without loading it into the memory.
+ */
+#define INSTDB_MAGIC        "I2MT"
+#define INSTDB_VERSION      1
+#define INSTDB_HEAD_SIZE    12
+
+struct InstDatabase
+{
+    /* Text table loaded from regtable.txt */
+    jwHashTable   *text;
+    /* Binary database, mapped or opened as a file */
+    const uint8_t *binData;
+    size_t         binSize;
+    FILE          *binFile;
+    uint32_t       binCount;
+    /* Packed copy of text table for the nearest instrument search */
+    uint8_t       *textKeys;
+    uint8_t       *textPatches;
+    uint32_t       textCount;
+};
+
+static int instDbOpenBinary(struct InstDatabase *db, const char *path)
+{
+    uint8_t  head[INSTDB_HEAD_SIZE];
+    uint32_t count;
+    long     fileSize;
+    FILE    *f = fopen(path, "rb");
+
+    if(!f)
+        return 0;
+
+    if((fread(head, 1, INSTDB_HEAD_SIZE, f) != INSTDB_HEAD_SIZE) ||
+       (memcmp(head, INSTDB_MAGIC, 4) != 0) ||
+       ((head[4] | (head[5] << 8)) != INSTDB_VERSION) ||
+       ((head[6] | (head[7] << 8)) != INST_FP_SIZE))
+    {
+        logMessage(IMF2MID_LOG_WARN, "%s is not a valid instrument database!\n\n", path);
+        fclose(f);
+        return 0;
+    }
+
+    count  = (uint32_t)head[8] | ((uint32_t)head[9] << 8) |
+             ((uint32_t)head[10] << 16) | ((uint32_t)head[11] << 24);
+
+    fseek(f, 0, SEEK_END);
+    fileSize = ftell(f);
+    /* Count is checked by division, so the huge one can't wrap around */
+    if((fileSize < INSTDB_HEAD_SIZE) ||
+       (count > ((uint32_t)fileSize - INSTDB_HEAD_SIZE) / (INST_FP_SIZE + 1)))
+    {
+        logMessage(IMF2MID_LOG_WARN, "Instrument database %s is truncated!\n\n", path);
+        fclose(f);
+        return 0;
+    }
+
+    db->binCount = count;
+
+#ifdef ENABLE_MMAP_INSTDB
+    {
+        int   fd = open(path, O_RDONLY);
+        void *data = MAP_FAILED;
+
+        if(fd >= 0)
+        {
+            data = mmap(NULL, (size_t)fileSize, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+        }
+
+        if(data != MAP_FAILED)
+        {
+            db->binData = (const uint8_t *)data;
+            db->binSize = (size_t)fileSize;
+            fclose(f);
+            return 1;
+        }
+    }
+#endif
+
+    /* Search directly in the file */
+    db->binFile = f;
+    return 1;
+}
+
+static int instDbFindBinary(struct InstDatabase *db, const uint8_t *fp, int *patch)
+{
+    uint32_t lo = 0, hi = db->binCount;
+    uint32_t patchesAt = INSTDB_HEAD_SIZE + (db->binCount * INST_FP_SIZE);
+    uint8_t  key[INST_FP_SIZE];
+
+    while(lo < hi)
+    {
+        uint32_t mid = lo + ((hi - lo) / 2);
+        uint32_t keyAt = INSTDB_HEAD_SIZE + (mid * INST_FP_SIZE);
+        const uint8_t *k = key;
+        int cmp;
+
+        if(db->binData)
+            k = db->binData + keyAt;
+        else
+        {
+            fseek(db->binFile, (long)keyAt, SEEK_SET);
+            if(fread(key, 1, INST_FP_SIZE, db->binFile) != INST_FP_SIZE)
+                return 0;
+        }
+
+        cmp = memcmp(k, fp, INST_FP_SIZE);
+        if(cmp == 0)
+        {
+            if(db->binData)
+                *patch = (int)db->binData[patchesAt + mid];
+            else
+            {
+                fseek(db->binFile, (long)(patchesAt + mid), SEEK_SET);
+                *patch = fgetc(db->binFile);
+                if(*patch < 0)
+                    return 0;
+            }
+            return 1;
+        }
+
+        if(cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Loads the instrument detection table
+ * @param db database to initialize
+ *
+ * The binary regtable.bin is preferred, then the text regtable.txt,
+ * and the built-in table is used when none of them exist.
+ */
+static void instDbLoad(struct InstDatabase *db)
+{
+    memset(db, 0, sizeof(struct InstDatabase));
+
+    if(!instDbOpenBinary(db, "regtable.bin"))
+        db->text = loadInstMap();
+}
+
+static void instDbClose(struct InstDatabase *db)
+{
+    if(db->text)
+        delete_hash(db->text);
+
+#ifdef ENABLE_MMAP_INSTDB
+    if(db->binData)
+        munmap((void *)db->binData, db->binSize);
+#endif
+
+    if(db->binFile)
+        fclose(db->binFile);
+
+    if(db->textKeys)
+        free(db->textKeys);
+
+    memset(db, 0, sizeof(struct InstDatabase));
+}
+
+static int instDbIsBinary(struct InstDatabase *db)
+{
+    return (db->binData != NULL) || (db->binFile != NULL);
+}
+
+/*
+ * Instrument tables shared by all conversions of the process: the
+ * detection table is loaded once, and patches chosen for unknown
+ * instruments are remembered to be the same in all next songs.
+ */
+static struct InstDatabase  INST_db;
+static int                  INST_dbLoaded = 0;
+static jwHashTable         *INST_learned = NULL;
+/* Count of random patches chosen by this run */
+static uint32_t             INST_randCount = 0;
+
+static struct InstDatabase *instDbShared(void)
+{
+    if(!INST_dbLoaded)
+    {
+        instDbLoad(&INST_db);
+        INST_dbLoaded = 1;
+    }
+    return &INST_db;
+}
+
+/*****************************************************************/
+
+
+/*****************************************************************
+ *                 Nearest instrument matching                   *
+ *****************************************************************/
+
+/* Weights of register fields in the distance between two instruments */
+#define FUZZY_W_MULT        4   /* Frequency multiplier, per step */
+#define FUZZY_W_FLAGS       6   /* Each of AM, VIB, EG and KSR bits */
+#define FUZZY_W_KSL         2   /* Key scale level, per step */
+#define FUZZY_W_RATE        2   /* Attack and decay rates, per step */
+#define FUZZY_W_FEEDBACK    3   /* Modulator feedback, per step */
+#define FUZZY_W_CONNECTION  40  /* FM against additive synthesis */
+#define FUZZY_W_WAVE        12  /* Different waveform */
+/* Raised on every change of weights, so the cached matches get found again */
+#define FUZZY_METRIC_VERSION 2
+
+#define FUZZY_MAX_DISTANCE  (2 * (15 * FUZZY_W_MULT + 4 * FUZZY_W_FLAGS) + \
+                             2 * 3 * FUZZY_W_KSL + \
+                             4 * 15 * FUZZY_W_RATE + 7 * FUZZY_W_FEEDBACK + \
+                             FUZZY_W_CONNECTION + 2 * FUZZY_W_WAVE)
+
+#define FUZZY_NONE          0xFFFFFFFFUL
+
+/* Count of set bits in every nibble value */
+static const uint8_t fuzzy_bits[16] =
+{
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+};
+
+struct FuzzyMatch
+{
+    uint32_t distance;
+    uint32_t index;
+    int      patch;
+};
+
+static uint32_t fuzzyStep(uint8_t a, uint8_t b)
+{
+    return (a > b) ? (uint32_t)(a - b) : (uint32_t)(b - a);
+}
+
+/**
+ * @brief Computes weighted distance between two fingerprints
+ * @param a first fingerprint
+ * @param b second fingerprint
+ * @param limit distance to stop counting at
+ * @return distance, or any value larger than limit when it's exceeded
+ */
+static uint32_t fuzzyDistance(const uint8_t *a, const uint8_t *b, uint32_t limit)
+{
+    uint32_t d = 0;
+    int op;
+
+    /* Connection and waveforms go first: they differ more often */
+    d += ((a[8] ^ b[8]) & 0x01) * FUZZY_W_CONNECTION;
+    d += fuzzyStep((a[8] >> 1) & 0x07, (b[8] >> 1) & 0x07) * FUZZY_W_FEEDBACK;
+    d += ((a[9] & 0x07) != (b[9] & 0x07)) * FUZZY_W_WAVE;
+    d += ((a[10] & 0x07) != (b[10] & 0x07)) * FUZZY_W_WAVE;
+    if(d > limit)
+        return d;
+
+    for(op = 0; op < 2; op++)
+    {
+        d += fuzzyStep(a[op] & 0x0F, b[op] & 0x0F) * FUZZY_W_MULT;
+        d += fuzzy_bits[(a[op] ^ b[op]) >> 4] * FUZZY_W_FLAGS;
+        d += fuzzyStep(a[4 + op] >> 4, b[4 + op] >> 4) * FUZZY_W_RATE;
+        d += fuzzyStep(a[4 + op] & 0x0F, b[4 + op] & 0x0F) * FUZZY_W_RATE;
+    }
+    if(d > limit)
+        return d;
+
+    d += fuzzyStep(a[2] >> 6, b[2] >> 6) * FUZZY_W_KSL;
+    d += fuzzyStep(a[3] >> 6, b[3] >> 6) * FUZZY_W_KSL;
+    /* Output level of the carrier (a[3] & 0x3F) is the volume of the note,
+     * not its timbre, and the one of the modulator isn't in the fingerprint */
+
+    return d;
+}
+
+static void fuzzyTest(struct FuzzyMatch *best, const uint8_t *fp,
+                      const uint8_t *key, uint32_t index, int patch)
+{
+    uint32_t d = fuzzyDistance(fp, key, best->distance);
+    if(d < best->distance)
+    {
+        best->distance = d;
+        best->index = index;
+        best->patch = patch;
+    }
+}
+
+static int fuzzyHexDigit(char c)
+{
+    if((c >= '0') && (c <= '9'))
+        return c - '0';
+    if((c >= 'A') && (c <= 'F'))
+        return c - 'A' + 10;
+    if((c >= 'a') && (c <= 'f'))
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Converts the key of text table back into the fingerprint */
+static int fuzzyParseKey(const char *hex, uint8_t *fp)
+{
+    size_t i;
+
+    for(i = 0; i < INST_FP_SIZE; i++)
+    {
+        int hi = fuzzyHexDigit(hex[i * 2]);
+        int lo = (hi < 0) ? -1 : fuzzyHexDigit(hex[i * 2 + 1]);
+        if(lo < 0)
+            return 0;
+        fp[i] = (uint8_t)((hi << 4) | lo);
+    }
+
+    return 1;
+}
+
+/* Unpacks the text table once to don't parse its keys on every search */
+static int fuzzyPackText(struct InstDatabase *db)
+{
+    jwHashTable *table = db->text;
+    uint32_t count = 0;
+    unsigned long b;
+
+    for(b = 0; b < table->buckets; b++)
+    {
+        jwHashEntry *entry = table->bucket[b];
+        for(; entry; entry = entry->next)
+            count++;
+    }
+
+    if(count == 0)
+        return 0;
+
+    db->textKeys = (uint8_t *)malloc(count * (INST_FP_SIZE + 1));
+    if(!db->textKeys)
+        return 0;
+    db->textPatches = db->textKeys + (count * INST_FP_SIZE);
+
+    for(b = 0; b < table->buckets; b++)
+    {
+        jwHashEntry *entry = table->bucket[b];
+        for(; entry; entry = entry->next)
+        {
+            uint8_t *key = db->textKeys + (db->textCount * INST_FP_SIZE);
+            if(fuzzyParseKey(entry->key.strValue, key))
+                db->textPatches[db->textCount++] = (uint8_t)(entry->value.intValue % 128);
+        }
+    }
+
+    return 1;
+}
+
+static void fuzzyScanText(struct InstDatabase *db, const uint8_t *fp, struct FuzzyMatch *best)
+{
+    uint32_t i;
+
+    if(!db->textKeys && !fuzzyPackText(db))
+        return;
+
+    for(i = 0; i < db->textCount; i++)
+        fuzzyTest(best, fp, db->textKeys + (i * INST_FP_SIZE), i, (int)db->textPatches[i]);
+}
+
+static void fuzzyScanBinary(struct InstDatabase *db, const uint8_t *fp, struct FuzzyMatch *best)
+{
+    uint32_t patchesAt = INSTDB_HEAD_SIZE + (db->binCount * INST_FP_SIZE);
+    uint32_t i;
+
+    if(db->binData)
+    {
+        for(i = 0; i < db->binCount; i++)
+            fuzzyTest(best, fp, db->binData + INSTDB_HEAD_SIZE + (i * INST_FP_SIZE), i, 0);
+        if(best->distance != FUZZY_NONE)
+            best->patch = (int)db->binData[patchesAt + best->index];
+    }
+    else
+    {
+        uint8_t  keys[64 * INST_FP_SIZE];
+        uint32_t got = 0;
+
+        fseek(db->binFile, INSTDB_HEAD_SIZE, SEEK_SET);
+        for(i = 0; i < db->binCount; i += got)
+        {
+            uint32_t j, want = db->binCount - i;
+            if(want > 64)
+                want = 64;
+            got = (uint32_t)fread(keys, INST_FP_SIZE, want, db->binFile);
+            if(got == 0)
+                break;
+            for(j = 0; j < got; j++)
+                fuzzyTest(best, fp, keys + (j * INST_FP_SIZE), i + j, 0);
+        }
+
+        if(best->distance != FUZZY_NONE)
+        {
+            fseek(db->binFile, (long)(patchesAt + best->index), SEEK_SET);
+            best->patch = fgetc(db->binFile);
+            if(best->patch < 0)
+                best->distance = FUZZY_NONE;
+        }
+    }
+}
+
+static void fuzzyScanBuiltin(const uint8_t *fp, struct FuzzyMatch *best)
+{
+#if REGTABLE_COUNT > 0
+    uint32_t i;
+    for(i = 0; i < REGTABLE_COUNT; i++)
+        fuzzyTest(best, fp, regtable_keys[i], i, (int)regtable_patch[i]);
+#else
+    (void)fp;
+    (void)best;
+#endif
+}
+
+/**
+ * @brief Finds the most similar instrument of the detection table
+ * @param db instrument database
+ * @param fp fingerprint of instrument
+ * @param patch patch of the closest instrument
+ * @param confidence similarity of instruments in percents
+ * @return 1 if any instrument was found, 0 if table is empty
+ *
+ * Every entry is checked, but the distance stops being counted as soon
+ * as it exceeds the best one, so most entries are rejected after a few
+ * fields. The same table as for exact lookup is searched.
+ */
+static int instDbFindNearest(struct InstDatabase *db, const uint8_t *fp, int *patch, int *confidence)
+{
+    struct FuzzyMatch best;
+
+    best.distance = FUZZY_NONE;
+    best.index = 0;
+    best.patch = 0;
+
+    if(db->text)
+        fuzzyScanText(db, fp, &best);
+    else if(instDbIsBinary(db))
+        fuzzyScanBinary(db, fp, &best);
+    else
+        fuzzyScanBuiltin(fp, &best);
+
+    if(best.distance == FUZZY_NONE)
+        return 0;
+
+    *patch = best.patch % 128;
+    *confidence = 100 - (int)(((best.distance * 100) + FUZZY_MAX_DISTANCE - 1) / FUZZY_MAX_DISTANCE);
+    return 1;
+}
+
+/*****************************************************************/
+
+
+/*****************************************************************
+ *                 Nearest instrument match cache                *
+ *****************************************************************/
+
+/*
+ * Results of the nearest instrument search are kept in the fzcache.txt
+ * between runs. The first line contains a checksum of the detection
+ * table, and the cache gets started over when the table was changed.
+ * Every next line is an entry written in the same way as regtable.txt:
+ *   FINGERPRINT|PATCH|CONFIDENCE
+ * New entries are appended to the end of file as soon as they found.
+ */
+#define FZCACHE_FILE    "fzcache.txt"
+#define FZCACHE_HEAD    "IMF2MID-FZCACHE 1 "
+
+static jwHashTable *FZ_cache = NULL;
+static FILE        *FZ_cacheFile = NULL;
+static int          FZ_cacheReady = 0;
+
+static uint32_t fuzzyHashData(uint32_t h, const uint8_t *data, size_t size)
+{
+    while(size-- > 0)
+    {
+        h ^= *data++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+/* Computes the checksum of the table the nearest instruments are searched in, and of the distance metric */
+static uint32_t fuzzyTableVersion(struct InstDatabase *db)
+{
+    uint32_t h = 2166136261UL ^ FUZZY_METRIC_VERSION;
+
+    if(db->text)
+    {
+        if(db->textKeys || fuzzyPackText(db))
+        {
+            h = fuzzyHashData(h, db->textKeys, db->textCount * INST_FP_SIZE);
+            h = fuzzyHashData(h, db->textPatches, db->textCount);
+        }
+    }
+    else if(db->binData)
+        h = fuzzyHashData(h, db->binData, db->binSize);
+    else if(db->binFile)
+    {
+        uint8_t chunk[512];
+        size_t  got;
+
+        fseek(db->binFile, 0, SEEK_SET);
+        while((got = fread(chunk, 1, sizeof(chunk), db->binFile)) > 0)
+            h = fuzzyHashData(h, chunk, got);
+    }
+    else
+    {
+#if REGTABLE_COUNT > 0
+        h = fuzzyHashData(h, &regtable_keys[0][0], sizeof(regtable_keys));
+        h = fuzzyHashData(h, regtable_patch, sizeof(regtable_patch));
+#endif
+    }
+
+    return h;
+}
+
+static void fuzzyCacheOpen(struct InstDatabase *db)
+{
+    char  line[101];
+    char  head[32];
+    FILE *f;
+
+    FZ_cacheReady = 1;
+    FZ_cache = create_hash(256);
+    if(!FZ_cache)
+        return;
+
+    sprintf(head, FZCACHE_HEAD "%08lX\n", (unsigned long)fuzzyTableVersion(db));
+
+    f = fopen(FZCACHE_FILE, "r");
+    if(f)
+    {
+        if(fgets(line, sizeof(line), f) && (strcmp(line, head) == 0))
+        {
+            while(fgets(line, sizeof(line), f))
+            {
+                if((strlen(line) < 30) || (line[22] != '|') || (line[26] != '|'))
+                    continue;
+                line[22] = '\0';
+                add_int_by_str(FZ_cache, line, (long)(atoi(line + 23) | (atoi(line + 27) << 8)));
+            }
+            fclose(f);
+            FZ_cacheFile = fopen(FZCACHE_FILE, "a");
+            return;
+        }
+        fclose(f);
+    }
+
+    /* Cache doesn't exist yet or was made for another table */
+    FZ_cacheFile = fopen(FZCACHE_FILE, "w");
+    if(FZ_cacheFile)
+        fputs(head, FZ_cacheFile);
+}
+
+static int fuzzyCacheFind(struct InstDatabase *db, char *key, int *patch, int *confidence)
+{
+    int val;
+
+    if(!FZ_cacheReady)
+        fuzzyCacheOpen(db);
+
+    if(!FZ_cache || (get_int_by_str(FZ_cache, key, &val) != HASHOK))
+        return 0;
+
+    *patch = val & 0xFF;
+    *confidence = val >> 8;
+    return 1;
+}
+
+static void fuzzyCacheStore(char *key, int patch, int confidence)
+{
+    if(FZ_cache)
+        add_int_by_str(FZ_cache, key, (long)(patch | (confidence << 8)));
+
+    if(FZ_cacheFile)
+    {
+        fprintf(FZ_cacheFile, "%s|%03d|%03d\n", key, patch, confidence);
+        fflush(FZ_cacheFile);
+    }
+}
+
+static void fuzzyCacheClose(void)
+{
+    if(FZ_cache)
+        FZ_cache = (jwHashTable *)delete_hash(FZ_cache);
+
+    if(FZ_cacheFile)
+    {
+        fclose(FZ_cacheFile);
+        FZ_cacheFile = NULL;
+    }
+
+    FZ_cacheReady = 0;
+}
+
+/*****************************************************************/
+
+
+/*****************************************************************
+ *                        Patch detection                        *
+ *****************************************************************/
+
+/**
+ * @brief Looks up the instrument in the loaded detection table
+ * @param db instrument database
+ * @param fp fingerprint of instrument
+ * @param key fingerprint written as text table key
+ * @param patch found patch
+ * @return 1 if instrument was found, 0 if not
+ */
+static int instDbFind(struct InstDatabase *db, const uint8_t *fp, char *key, int *patch)
+{
+    if(db->text)
+        return (get_int_by_str(db->text, key, patch) == HASHOK);
+    else if(instDbIsBinary(db))
+        return instDbFindBinary(db, fp, patch);
+    else
+        return builtinFindPatch(fp, patch);
+}
+
+static void instKeyString(const uint8_t *fp, char *key)
+{
+    sprintf(key,
+           "%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X",
+            fp[0], fp[1], fp[2], fp[3], fp[4], fp[5],
+            fp[6], fp[7], fp[8], fp[9], fp[10]);
+}
+
+static uint8_t detectPatch(struct InstDatabase *db, struct AdLibInstrument *inst, int fuzzy)
+{
+    char instBuff[27];
+    uint8_t fp[INST_FP_SIZE];
+    int val = 0;
+    int found = 0;
+    int confidence = 0;
+
+    instFingerprint(inst, fp);
+    instKeyString(fp, instBuff);
+
+    found = instDbFind(db, fp, instBuff, &val);
+
+    if(found)
+    {
+        logMessage(IMF2MID_LOG_DEBUG, "Detected instrument %03d\n", val);
+        return (uint8_t)(val % 128);
+    }
+
+    if(!INST_learned)
+        INST_learned = create_hash(256);
+
+    if(INST_learned && (get_int_by_str(INST_learned, instBuff, &val) == HASHOK))
+    {
+        logMessage(IMF2MID_LOG_DEBUG, "INSTRUMENT NOT FOUND, USING PREVIOUSLY CHOSEN %03d\n", val);
+    } else {
+        if(fuzzy && fuzzyCacheFind(db, instBuff, &val, &confidence))
+        {
+            logMessage(IMF2MID_LOG_DEBUG, "INSTRUMENT NOT FOUND, USING CACHED NEAREST %03d (CONFIDENCE %d%%)\n", val, confidence);
+        }
+        else if(fuzzy && instDbFindNearest(db, fp, &val, &confidence))
+        {
+            logMessage(IMF2MID_LOG_DEBUG, "INSTRUMENT NOT FOUND, USING NEAREST %03d (CONFIDENCE %d%%)\n", val, confidence);
+            fuzzyCacheStore(instBuff, val, confidence);
+        } else {
+            val = rand() % 128;
+            INST_randCount++;
+            logMessage(IMF2MID_LOG_DEBUG, "INSTRUMENT NOT FOUND, USING RANDOM %03d\n", val);
+        }
+        if(INST_learned)
+            add_int_by_str(INST_learned, instBuff, (long)val);
+    }
+
+    return (uint8_t)val;
+}
+
+/*
+ * Instrument log: lines are collected in the memory, every distinct
+ * line is kept once per run, and all of them are appended to the
+ * instlog.txt by one write on exit or when buffer is getting full.
+ */
+#define INST_LOG_FILE       "instlog.txt"
+#define INST_LOG_FLUSH_SIZE 16384
+
+static jwHashTable *INST_logSeen = NULL;
+static char        *INST_logBuf = NULL;
+static size_t       INST_logSize = 0;
+
+static void instLogFlush(void)
+{
+    FILE *f;
+
+    if(INST_logSize == 0)
+        return;
+
+    f = fopen(INST_LOG_FILE, "a");
+    if(f)
+    {
+        /* Unbuffered stream writes the whole block at once, so appends of other runs don't get into it */
+        setvbuf(f, NULL, _IONBF, 0);
+        fwrite(INST_logBuf, 1, INST_logSize, f);
+        fclose(f);
+    }
+    else
+        logMessage(IMF2MID_LOG_WARN, "Can't open file %s for write!\n\n", INST_LOG_FILE);
+
+    INST_logSize = 0;
+}
+
+static void instLogAdd(char *line)
+{
+    int dummy;
+    size_t len = strlen(line);
+
+    if(!INST_logSeen)
+        INST_logSeen = create_hash(256);
+    if(!INST_logBuf)
+        INST_logBuf = (char *)malloc(INST_LOG_FLUSH_SIZE);
+    if(!INST_logSeen || !INST_logBuf)
+        return;
+
+    if(get_int_by_str(INST_logSeen, line, &dummy) == HASHOK)
+        return;
+    add_int_by_str(INST_logSeen, line, 0);
+
+    if(INST_logSize + len > INST_LOG_FLUSH_SIZE)
+        instLogFlush();
+
+    memcpy(INST_logBuf + INST_logSize, line, len);
+    INST_logSize += len;
+}
+
+static void instLogClose(void)
+{
+    instLogFlush();
+
+    if(INST_logSeen)
+        INST_logSeen = (jwHashTable *)delete_hash(INST_logSeen);
+
+    if(INST_logBuf)
+    {
+        free(INST_logBuf);
+        INST_logBuf = NULL;
+    }
+}
+
+static void printInst(struct AdLibInstrument *inst, uint8_t channel, int logInstruments)
+{
+    if(logInstruments)
+    {
+        char line[32];
+        sprintf(line,
+               "%02X%02X"
+               "%02X%02X"
+               "%02X%02X"
+               "%02X%02X"
+               "%02X"
+               "%02X%02X|%03d\n"
+               ,
+                inst->reg20[0], inst->reg20[1],
+               (inst->reg40[0] & 0xC0), inst->reg40[1],
+                inst->reg60[0], inst->reg60[1],
+                inst->reg60[0], inst->reg60[1],
+                inst->regC0,
+                inst->regE0[0], inst->regE0[1],
+                (int)channel
+               );
+        instLogAdd(line);
+    }
+
+    logMessage(IMF2MID_LOG_DEBUG,
+               "%d) "
+               "20:[%02X %02X]; "
+               "40:[%02X %02X]; "
+               "60:[%02X %02X]; "
+               "80:[%02X %02X]; "
+               "C0:[%02X]; "
+               "E0:[%02X %02X]\n"
+               ,
+                (int)channel,
+                inst->reg20[0], inst->reg20[1],
+               (inst->reg40[0] & 0xC0), inst->reg40[1],
+                inst->reg60[0], inst->reg60[1],
                 inst->reg60[0], inst->reg60[1],
                 inst->regC0,
                 inst->regE0[0], inst->regE0[1]
                );
+}
+/*****************************************************************/
+
+
+/*****************************************************************
+ *                 Per-song instrument interning                 *
+ *****************************************************************/
+
+#define INST_CACHE_SIZE     128
+#define INST_CACHE_BUCKETS  64
+#define INST_KEY_SIZE       10
+#define INST_NONE           0xFFFF
+
+struct InstCacheEntry
+{
+    uint8_t  key[INST_KEY_SIZE];
+    int16_t  patch; /* -1 until detected */
+    uint8_t  level; /* Carrier level the patch was detected for, it's a part of the fingerprint */
+    uint16_t next;
+};
+
+static struct InstCacheEntry INST_cache[INST_CACHE_SIZE];
+static uint16_t INST_cacheBucket[INST_CACHE_BUCKETS];
+static uint16_t INST_cacheCount = 0;
+
+/* Packs the same fields which are compared by instcmp() */
+static void instKey(struct AdLibInstrument *inst, uint8_t *key)
+{
+    key[0] = inst->reg20[0];
+    key[1] = inst->reg20[1];
+    key[2] = inst->reg40[0] & 0xC0;
+    key[3] = inst->reg60[0];
+    key[4] = inst->reg60[1];
+    key[5] = inst->reg80[0];
+    key[6] = inst->reg80[1];
+    key[7] = inst->regC0;
+    key[8] = inst->regE0[0];
+    key[9] = inst->regE0[1];
+}
+
+static void instCacheReset(void)
+{
+    memset(INST_cacheBucket, 0xFF, sizeof(INST_cacheBucket));
+    INST_cacheCount = 0;
+}
+
+/**
+ * @brief Finds an ID of instrument, or adds it into the table of the song
+ * @param inst instrument to intern
+ * @return ID of instrument, or INST_NONE if table is full
+ */
+static uint16_t instIntern(struct AdLibInstrument *inst)
+{
+    uint8_t  key[INST_KEY_SIZE];
+    uint16_t hash = 5381;
+    uint16_t id;
+    size_t   i;
+
+    instKey(inst, key);
+    for(i = 0; i < INST_KEY_SIZE; i++)
+        hash = (uint16_t)((hash << 5) + hash + key[i]);
+    hash %= INST_CACHE_BUCKETS;
+
+    for(id = INST_cacheBucket[hash]; id != INST_NONE; id = INST_cache[id].next)
+    {
+        if(memcmp(INST_cache[id].key, key, INST_KEY_SIZE) == 0)
+            return id;
+    }
+
+    if(INST_cacheCount >= INST_CACHE_SIZE)
+        return INST_NONE;
+
+    id = INST_cacheCount++;
+    memcpy(INST_cache[id].key, key, INST_KEY_SIZE);
+    INST_cache[id].patch = -1;
+    INST_cache[id].level = 0;
+    INST_cache[id].next  = INST_cacheBucket[hash];
+    INST_cacheBucket[hash] = id;
+
+    return id;
+}
+/*****************************************************************/
+
+
+/*****************************************************************
+ *                      Helper functions                         *
+ *****************************************************************/
+/**
+ * @brief Calculates the pitch bend of the F-number
+ * @param freq F-number
+ * @return pitch bend value, or FREQ_PITCH_KEEP if previous value should stay
+ */
+static uint16_t freqToPitch(int16_t freq)
+{
+    int16_t nextfreqIndex = nearestFreqCalc((uint16_t)freq);
+    int16_t nextfreq = (int16_t)note_frequencies[nextfreqIndex];
+
+    if(nextfreq == freq)
+    {
+        /* Default state */
+        return MIDI_PITCH_CENTER;
+    }
+
+    if(freq == 0)
+        return FREQ_PITCH_KEEP;
+
+    if(nextfreq > freq)
+    {
+        /* Pitch Up */
+        /* Two half-tones up */
+        int16_t freqR = relativeFreq(nextfreqIndex, 2);
+        if(freqR >= 0)
+        {
+            /* pitch relative */
+            return (uint16_t)(MIDI_PITCH_CENTER
+                            + (0x2000 * (((double)freq - (double)nextfreq) / ((double)freqR - (double)nextfreq))) );
+        }
+    }
+    else
+    {
+        /* Pitch down */
+        /* Two half-tones down */
+        int16_t freqR = relativeFreq(nextfreqIndex, -2);
+        if(freqR >= 0)
+        {
+            /* pitch relative */
+            return (uint16_t)(MIDI_PITCH_CENTER
+                            - (0x2000 * (((double)nextfreq - (double)freq) / ((double)nextfreq - (double)freqR))) );
+        }
+    }
+
+    return FREQ_PITCH_KEEP;
+}
+
+static void freqInitTables(void)
+{
+    uint16_t hz;
+
+    for(hz = 0; hz < FREQ_COUNT; hz++)
+    {
+        FREQ_nearest[hz] = nearestFreqCalc(hz);
+        FREQ_pitch[hz]   = freqToPitch((int16_t)hz);
+    }
+
+    FREQ_ready = 1;
+}
+
+static void makePitch(/*FILE* f*/uint16_t *pitchs, /*struct Imf2MIDI_CVT *cvt,*/ int16_t freq, uint8_t channel)
+{
+    uint16_t pitch;
+
+    if((freq >= 0) && (freq < FREQ_COUNT))
+    {
+        if(!FREQ_ready)
+            freqInitTables();
+        pitch = FREQ_pitch[freq];
+    }
+    else
+        pitch = freqToPitch(freq);
+
+    if(pitch != FREQ_PITCH_KEEP)
+        pitchs[channel] = pitch;
+}
+/*****************************************************************/
+
+
+/*****************************************************************
+ *                     Instrument discovery                      *
+ *****************************************************************/
+
+/*
+ * Counts instruments used in a whole set of songs to find candidates
+ * for the detection table: how many notes were played with every
+ * instrument, and in how many songs it was used.
+ */
+struct DiscoveryEntry
+{
+    uint8_t  fp[INST_FP_SIZE];
+    uint32_t uses;
+    uint32_t songs;
+    uint32_t lastSong;
+    uint32_t next;
+};
+
+#define DISC_NONE   0xFFFFFFFFUL
+
+static struct DiscoveryEntry *DISC_entries = NULL;
+static uint32_t               DISC_count = 0;
+static uint32_t               DISC_capacity = 0;
+static uint32_t              *DISC_bucket = NULL;
+static uint32_t               DISC_buckets = 0;
+static uint32_t               DISC_songs = 0;
+
+static void discoveryReset(void)
+{
+    if(DISC_entries)
+        free(DISC_entries);
+    if(DISC_bucket)
+        free(DISC_bucket);
+    DISC_entries = NULL;
+    DISC_bucket = NULL;
+    DISC_count = 0;
+    DISC_capacity = 0;
+    DISC_buckets = 0;
+    DISC_songs = 0;
+}
+
+/* Doubles the space for entries and rebuilds the hash index */
+static int discoveryGrow(void)
+{
+    uint32_t newCapacity = DISC_capacity ? (DISC_capacity * 2) : 1024;
+    struct DiscoveryEntry *entries;
+    uint32_t *bucket;
+    uint32_t i;
+
+    entries = (struct DiscoveryEntry *)realloc(DISC_entries, newCapacity * sizeof(struct DiscoveryEntry));
+    if(!entries)
+        return 0;
+    DISC_entries = entries;
+
+    bucket = (uint32_t *)realloc(DISC_bucket, newCapacity * sizeof(uint32_t));
+    if(!bucket)
+        return 0;
+    DISC_bucket = bucket;
+
+    DISC_capacity = newCapacity;
+    DISC_buckets = newCapacity;
+    for(i = 0; i < DISC_buckets; i++)
+        DISC_bucket[i] = DISC_NONE;
+
+    for(i = 0; i < DISC_count; i++)
+    {
+        uint32_t h = instHash(DISC_entries[i].fp, 0) & (DISC_buckets - 1);
+        DISC_entries[i].next = DISC_bucket[h];
+        DISC_bucket[h] = i;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Counts one more use of the instrument
+ * @param fp fingerprint of the instrument
+ * @return 1 if the instrument is used first time in the current song
+ */
+static int discoveryAdd(const uint8_t *fp)
+{
+    uint32_t h, i;
+
+    if(DISC_buckets > 0)
+    {
+        h = instHash(fp, 0) & (DISC_buckets - 1);
+        for(i = DISC_bucket[h]; i != DISC_NONE; i = DISC_entries[i].next)
+        {
+            struct DiscoveryEntry *e = &DISC_entries[i];
+            if(memcmp(e->fp, fp, INST_FP_SIZE) == 0)
+            {
+                e->uses++;
+                if(e->lastSong != DISC_songs)
+                {
+                    e->songs++;
+                    e->lastSong = DISC_songs;
+                    return 1;
+                }
+                return 0;
+            }
+        }
+    }
+
+    if((DISC_count >= DISC_capacity) && !discoveryGrow())
+        return 0;
+
+    h = instHash(fp, 0) & (DISC_buckets - 1);
+    i = DISC_count++;
+    memcpy(DISC_entries[i].fp, fp, INST_FP_SIZE);
+    DISC_entries[i].uses = 1;
+    DISC_entries[i].songs = 1;
+    DISC_entries[i].lastSong = DISC_songs;
+    DISC_entries[i].next = DISC_bucket[h];
+    DISC_bucket[h] = i;
+    return 1;
+}
+
+/* Most widely used instruments go first */
+static int discoveryCmp(const void *a, const void *b)
+{
+    const struct DiscoveryEntry *e1 = (const struct DiscoveryEntry *)a;
+    const struct DiscoveryEntry *e2 = (const struct DiscoveryEntry *)b;
+
+    if(e1->songs != e2->songs)
+        return (e1->songs > e2->songs) ? -1 : 1;
+    if(e1->uses != e2->uses)
+        return (e1->uses > e2->uses) ? -1 : 1;
+    return memcmp(e1->fp, e2->fp, INST_FP_SIZE);
+}
+
+/**
+ * @brief Walks all records of the song without converting it
+ * @param file_in opened song file, positioned after the length field
+ * @param imf_length length of the song data
+ * @param info summary to fill
+ * @param newInstrument called for every instrument first used in the song, may be NULL
+ *
+ * Only registers needed to recognize instruments are tracked, every
+ * instrument found is counted by the discovery table.
+ */
+static void scanSong(FILE *file_in, uint32_t imf_length, struct Imf2MIDI_SongInfo *info,
+                     void (*newInstrument)(const uint8_t *fp))
+{
+    struct AdLibInstrument inst[IMF2MID_CHANNELS];
+    uint8_t  keyOn[IMF2MID_CHANNELS];
+    uint8_t  pending[IMF2MID_CHANNELS];
+    uint8_t  fp[INST_FP_SIZE];
+    uint8_t  lastFp[IMF2MID_CHANNELS][INST_FP_SIZE];
+    uint8_t *imf_rec;
+    size_t   imf_blockSize = 0;
+    size_t   imf_blockPos = 0;
+    int      imf_eof = 0;
+    uint8_t  c;
+
+    memset(info, 0, sizeof(struct Imf2MIDI_SongInfo));
+    memset(inst, 0, sizeof(inst));
+    memset(keyOn, 0, sizeof(keyOn));
+    memset(pending, 0, sizeof(pending));
+    memset(lastFp, 0, sizeof(lastFp));
+
+    DISC_songs++;
+
+    for(;;)
+    {
+        uint8_t reg, val;
+
+        if(imf_blockPos >= imf_blockSize)
+        {
+            if((imf_length == 0) || imf_eof)
+                break;
+            imf_blockSize = IMF_readBlock(file_in, IMF_block, &imf_length, &imf_eof);
+            info->records += (uint32_t)imf_blockSize;
+            imf_blockSize = IMF_prescanBlock(IMF_block, imf_blockSize);
+            imf_blockPos  = 0;
+            continue;
+        }
+
+        imf_rec = IMF_block + (imf_blockPos * 4);
+        imf_blockPos++;
+        reg = imf_rec[2];
+        val = imf_rec[3];
+
+        /*
+         * Instruments are taken at the same moments as the converter does:
+         * on key-on, and when a sounding channel gets another instrument
+         */
+        if((imf_rec[0] | imf_rec[1]) || ((imf_length == 0) && (imf_blockPos == imf_blockSize)))
+        {
+            info->ticks += (uint32_t)imf_rec[0] | ((uint32_t)imf_rec[1] << 8);
+            for(c = 0; c < IMF2MID_CHANNELS; c++)
+            {
+                if(keyOn[c])
+                {
+                    instFingerprint(&inst[c], fp);
+                    if((pending[c] || (memcmp(fp, lastFp[c], INST_FP_SIZE) != 0)) && discoveryAdd(fp))
+                    {
+                        info->instruments++;
+                        if(newInstrument)
+                            newInstrument(fp);
+                    }
+                    memcpy(lastFp[c], fp, INST_FP_SIZE);
+                }
+                pending[c] = 0;
+            }
+        }
+
+        if((reg >= 0xB0) && (reg <= 0xB8))
+        {
+            c = reg - 0xB0;
+            if(((val >> 5) & 1) && !keyOn[c])
+            {
+                pending[c] = 1;
+                info->notes[c]++;
+            }
+            keyOn[c] = (val >> 5) & 1;
+        }
+        else if((reg >= 0x20) && (reg <= 0x35))
+            inst[opl2_opChannel[(reg - 0x20) % 0x15]].reg20[opl2_op[(reg - 0x20) % 0x15]] = val;
+        else if((reg >= 0x40) && (reg <= 0x55))
+            inst[opl2_opChannel[(reg - 0x40) % 0x15]].reg40[opl2_op[(reg - 0x40) % 0x15]] = val;
+        else if((reg >= 0x60) && (reg <= 0x75))
+            inst[opl2_opChannel[(reg - 0x60) % 0x15]].reg60[opl2_op[(reg - 0x60) % 0x15]] = val;
+        else if((reg >= 0xC0) && (reg <= 0xC8))
+            inst[reg - 0xC0].regC0 = val;
+        else if((reg >= 0xE0) && (reg <= 0xF5))
+            inst[opl2_opChannel[(reg - 0xE0) % 0x15]].regE0[opl2_op[(reg - 0xE0) % 0x15]] = val;
+    }
+}
+/*****************************************************************/
+
+
+
+/*****************************************************************
+ *                      Conversion state                         *
+ *****************************************************************/
+
+/*
+ * State file of the update mode keeps a content hash of every converted
+ * file, one per line:
+ *   HASH|path/to/file.imf
+ * A file is skipped when its hash is still the same and its MIDI file
+ * exists. The hash includes options and the instrument table, so any
+ * change of them makes all files be converted again.
+ * Every finished file is appended to the state at once as a journal,
+ * so the interrupted run continues from the same place. The state gets
+ * rewritten without repeated entries on exit.
+ */
+#define STATE_FILE  "convstate.txt"
+
+static jwHashTable *STATE_table = NULL;
+static int          STATE_loaded = 0;
+static int          STATE_dirty = 0;
+static FILE        *STATE_journal = NULL;
+/* Checksum of the instrument table, computed once after table was loaded */
+static uint32_t     STATE_tableVersion = 0;
+static int          STATE_tableVersionReady = 0;
+
+static void stateLoad(void)
+{
+    char  line[1024];
+    FILE *f;
+
+    STATE_loaded = 1;
+    STATE_table = create_hash(1024);
+    if(!STATE_table)
+        return;
+
+    f = fopen(STATE_FILE, "r");
+    if(!f)
+        return;
+
+    while(fgets(line, sizeof(line), f))
+    {
+        size_t len = strlen(line);
+        while((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == '\r')))
+            line[--len] = '\0';
+        if((len < 10) || (line[8] != '|'))
+            continue;
+        line[8] = '\0';
+        add_int_by_str(STATE_table, line + 9, (long)strtoul(line, NULL, 16));
+    }
+
+    fclose(f);
+}
+
+static void stateSave(void)
+{
+    FILE *f;
+    unsigned long b;
+
+    if(STATE_journal)
+    {
+        fclose(STATE_journal);
+        STATE_journal = NULL;
+    }
+
+    if(!STATE_table || !STATE_dirty)
+        return;
+
+    f = fopen(STATE_FILE, "w");
+    if(!f)
+    {
+        logMessage(IMF2MID_LOG_WARN, "Can't open file %s for write!\n\n", STATE_FILE);
+        return;
+    }
+
+    for(b = 0; b < STATE_table->buckets; b++)
+    {
+        jwHashEntry *entry;
+        for(entry = STATE_table->bucket[b]; entry; entry = entry->next)
+            fprintf(f, "%08lX|%s\n", (unsigned long)entry->value.intValue & 0xFFFFFFFFUL, entry->key.strValue);
+    }
+
+    fclose(f);
+    STATE_dirty = 0;
+}
+
+static void stateRecord(char *path, uint32_t hash)
+{
+    add_int_by_str(STATE_table, path, (long)hash);
+    STATE_dirty = 1;
+
+    if(!STATE_journal)
+        STATE_journal = fopen(STATE_FILE, "a");
+
+    if(STATE_journal)
+    {
+        fprintf(STATE_journal, "%08lX|%s\n", (unsigned long)hash, path);
+        fflush(STATE_journal);
+    }
+}
+
+static void stateClose(void)
+{
+    stateSave();
+
+    if(STATE_table)
+        STATE_table = (jwHashTable *)delete_hash(STATE_table);
+
+    STATE_loaded = 0;
+}
+
+/* Hashes everything except of the song which affects the result */
+static uint32_t stateSettingsHash(struct Imf2MIDI_CVT *cvt)
+{
+    uint8_t  settings[4];
+    uint32_t h;
+
+    if(!STATE_tableVersionReady)
+    {
+        STATE_tableVersion = fuzzyTableVersion(&INST_db);
+        STATE_tableVersionReady = 1;
+    }
+
+    h = 2166136261UL ^ STATE_tableVersion;
+
+    settings[0] = (uint8_t)cvt->flag_usePitch;
+    settings[1] = (uint8_t)cvt->flag_fuzzyMatch;
+    settings[2] = (uint8_t)cvt->flag_allocChannels;
+    settings[3] = (uint8_t)cvt->flag_optimize;
+    return fuzzyHashData(h, settings, sizeof(settings));
+}
+
+/* Hashes the content of the file together with everything else which affects the result */
+static int stateFileHash(struct Imf2MIDI_CVT *cvt, uint32_t *hash)
+{
+    uint8_t  chunk[512];
+    size_t   got;
+    uint32_t h;
+    FILE    *f = fopen(cvt->path_in, "rb");
+
+    if(!f)
+        return 0;
+
+    h = stateSettingsHash(cvt);
+
+    while((got = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        h = fuzzyHashData(h, chunk, got);
+
+    fclose(f);
+    *hash = h;
+    return 1;
+}
+
+static int stateIsUpToDate(struct Imf2MIDI_CVT *cvt, uint32_t hash)
+{
+    long  old;
+    FILE *f;
+
+    if(get_long_by_str(STATE_table, cvt->path_in, &old) != HASHOK)
+        return 0;
+
+    if(((uint32_t)old & 0xFFFFFFFFUL) != hash)
+        return 0;
+
+    f = fopen(cvt->path_out, "rb");
+    if(!f)
+        return 0;
+    fclose(f);
+
+    return 1;
+}
+/*****************************************************************/
+
+
+/*****************************************************************
+ *                        Archive output                         *
+ *****************************************************************/
+
+/*
+ * All converted songs can be stored into one uncompressed tar archive
+ * instead of separate files. Every song is stored as a regular file of
+ * the archive, and the index file (archive name with ".idx" suffix)
+ * gets a line for every song:
+ *   OFFSET SIZE NAME
+ * where OFFSET is the position of MIDI data in the archive, so any song
+ * can be read directly without parsing the archive.
+ * Songs are named by their relative output paths, or only by file names
+ * when output paths are absolute. Names longer than 100 characters are
+ * split between the name and prefix fields of the ustar header.
+ */
+#define ARCH_BLOCK      512
+#define ARCH_NAME_SIZE  100
+#define ARCH_PREFIX_SIZE 155
+
+static FILE    *ARCH_file = NULL;
+static FILE    *ARCH_index = NULL;
+static long     ARCH_end = 0;
+static unsigned long ARCH_mtime = 0;
+/* Name of the song being written, with the "/" separators */
+static char     ARCH_name[ARCH_PREFIX_SIZE + 1 + ARCH_NAME_SIZE + 1];
+
+/**
+ * @brief Makes the name of the song inside of the archive
+ * @param path output path of the song
+ * @return 0 if the name is too long to be stored
+ */
+static int archiveMakeName(const char *path)
+{
+    const char *name = path;
+    size_t len, i;
+
+    if((path[0] == '/') || (path[0] == '\\') || ((path[0] != '\0') && (path[1] == ':')))
+    {
+        /* Absolute path: only the file name */
+        for(i = 0; path[i] != '\0'; i++)
+        {
+            if((path[i] == '/') || (path[i] == '\\') || (path[i] == ':'))
+                name = path + i + 1;
+        }
+    }
+    else
+    {
+        /* Relative path without leading "./" and "../" */
+        for(;;)
+        {
+            if((name[0] == '.') && ((name[1] == '/') || (name[1] == '\\')))
+                name += 2;
+            else if((name[0] == '.') && (name[1] == '.') && ((name[2] == '/') || (name[2] == '\\')))
+                name += 3;
+            else
+                break;
+        }
+    }
+
+    len = strlen(name);
+    if(len >= sizeof(ARCH_name))
+        return 0;
+    for(i = 0; i <= len; i++)
+        ARCH_name[i] = (name[i] == '\\') ? '/' : name[i];
+
+    return 1;
+}
+
+/**
+ * @brief Finds where the name gets split between prefix and name fields of ustar
+ * @param name name of the song
+ * @return length of the prefix, 0 when the whole name fits, or -1 if it can't be split
+ */
+static int archiveSplitName(const char *name)
+{
+    size_t len = strlen(name);
+    size_t i;
+
+    if(len <= ARCH_NAME_SIZE)
+        return 0;
+
+    /* Prefix takes directories up to the "/" which leaves the rest short enough */
+    for(i = len - ARCH_NAME_SIZE - 1; (i < len) && (i <= ARCH_PREFIX_SIZE); i++)
+    {
+        if((name[i] == '/') && (i > 0) && (i + 1 < len))
+            return (int)i;
+    }
+
+    return -1;
+}
+
+static void archiveWriteHeader(FILE *f, const char *name, uint32_t size)
+{
+    char     head[ARCH_BLOCK];
+    unsigned long sum = 0;
+    size_t   i;
+    int      prefix = archiveSplitName(name);
+
+    memset(head, 0, ARCH_BLOCK);
+    if(prefix > 0)
+    {
+        memcpy(head + 345, name, (size_t)prefix);
+        name += prefix + 1;
+    }
+    memcpy(head, name, strlen(name));
+    sprintf(head + 100, "%07o", 0644);
+    sprintf(head + 108, "%07o", 0);
+    sprintf(head + 116, "%07o", 0);
+    sprintf(head + 124, "%011lo", (unsigned long)size);
+    sprintf(head + 136, "%011lo", ARCH_mtime);
+    head[156] = '0'; /* Regular file */
+    memcpy(head + 257, "ustar", 6);
+    memcpy(head + 263, "00", 2);
+
+    memset(head + 148, ' ', 8);
+    for(i = 0; i < ARCH_BLOCK; i++)
+        sum += (unsigned char)head[i];
+    sprintf(head + 148, "%06lo", sum);
+    head[155] = ' ';
+
+    fwrite(head, 1, ARCH_BLOCK, f);
+}
+
+static int archiveBegin(const char *path)
+{
+    if(!archiveMakeName(path) || (archiveSplitName(ARCH_name) < 0))
+    {
+        logMessage(IMF2MID_LOG_ERROR, "File name %s is too long to be stored into archive!\n\n", path);
+        return 0;
+    }
+
+    /* Data goes after the header which is written when size is known */
+    fbeginb(ARCH_file, ARCH_end + ARCH_BLOCK);
+    return 1;
+}
+
+static void archiveEnd(uint32_t size)
+{
+    char   zero[ARCH_BLOCK];
+    size_t pad = (ARCH_BLOCK - (size % ARCH_BLOCK)) % ARCH_BLOCK;
+
+    fseek(ARCH_file, ARCH_end, SEEK_SET);
+    archiveWriteHeader(ARCH_file, ARCH_name, size);
+
+    memset(zero, 0, ARCH_BLOCK);
+    fseek(ARCH_file, ARCH_end + ARCH_BLOCK + (long)size, SEEK_SET);
+    fwrite(zero, 1, pad, ARCH_file);
+
+    if(ARCH_index)
+        fprintf(ARCH_index, "%lu %lu %s\n", (unsigned long)(ARCH_end + ARCH_BLOCK), (unsigned long)size, ARCH_name);
+
+    ARCH_end += ARCH_BLOCK + (long)(size + pad);
+}
+
+int Imf2MIDI_openArchive(const char *path)
+{
+    char *indexPath;
+
+    Imf2MIDI_closeArchive();
+
+    ARCH_file = fopen(path, "wb");
+    if(!ARCH_file)
+    {
+        logMessage(IMF2MID_LOG_ERROR, "Can't open file %s for write!\n\n", path);
+        return 1;
+    }
+    setvbuf(ARCH_file, NULL, _IONBF, 0);
+
+    indexPath = (char *)malloc(strlen(path) + 5);
+    if(indexPath)
+    {
+        sprintf(indexPath, "%s.idx", path);
+        ARCH_index = fopen(indexPath, "w");
+        if(!ARCH_index)
+            logMessage(IMF2MID_LOG_WARN, "Can't open file %s for write!\n\n", indexPath);
+        free(indexPath);
+    }
+
+    ARCH_end = 0;
+    ARCH_mtime = (unsigned long)time(NULL);
+    return 0;
+}
+
+int Imf2MIDI_closeArchive(void)
+{
+    char zero[ARCH_BLOCK];
+    int  res = 0;
+
+    if(!ARCH_file)
+        return 0;
+
+    /* End of archive is marked by two empty blocks */
+    memset(zero, 0, ARCH_BLOCK);
+    fseek(ARCH_file, ARCH_end, SEEK_SET);
+    fwrite(zero, 1, ARCH_BLOCK, ARCH_file);
+    fwrite(zero, 1, ARCH_BLOCK, ARCH_file);
+
+    if(fclose(ARCH_file) != 0)
+        res = 1;
+    ARCH_file = NULL;
+
+    if(ARCH_index)
+    {
+        fclose(ARCH_index);
+        ARCH_index = NULL;
+    }
+
+    return res;
+}
+/*****************************************************************/
+
+
+/*****************************************************************
+ *                         Song catalog                          *
+ *****************************************************************/
+
+/*
+ * The catalog keeps summaries of a whole collection of songs in one
+ * file, so questions about the collection get answered without opening
+ * the songs. Format of the file (all integers are little-endian):
+ *   char[4]             magic "I2MC"
+ *   uint16              format version
+ *   uint16              size of fingerprint (11)
+ *   uint32              count of songs
+ *   uint32              count of instrument uses (all instruments of all songs)
+ *   uint32              size of paths
+ *   uint32[songs][15]   songs sorted by content hash: hash, ticks, records,
+ *                       notes on 9 channels, index of the first instrument,
+ *                       count of instruments, offset of the path
+ *   uint8[uses][11]     instruments of every song, in order of songs
+ *   uses * (uint8[11], uint32)
+ *                       fingerprint and index of song for every use, sorted
+ *                       by fingerprint and song
+ *   uint32[songs]       indices of songs sorted by duration
+ *   char[]              zero-terminated paths
+ * Update reads the existing catalog and scans again only songs with
+ * changed content.
+ */
+#define CAT_MAGIC       "I2MC"
+#define CAT_VERSION     1
+#define CAT_HEAD_SIZE   20
+#define CAT_SONG_SIZE   (24 + (IMF2MID_CHANNELS * 4))
+#define CAT_USE_SIZE    (INST_FP_SIZE + 4)
+
+/* Catalog file opened for reading */
+struct Catalog
+{
+    uint8_t       *data;
+    size_t         size;
+    int            mapped;
+    uint32_t       songs;
+    uint32_t       uses;
+    uint32_t       pathsSize;
+    const uint8_t *records;
+    const uint8_t *fps;
+    const uint8_t *byInstrument;
+    const uint8_t *byDuration;
+    const char    *paths;
+};
+
+/* Song of the catalog being updated */
+struct CatalogSong
+{
+    uint32_t hash;
+    struct Imf2MIDI_SongInfo info;
+    uint32_t fpFirst;
+    char    *path;
+};
+
+static char               *CAT_path = NULL;
+static struct CatalogSong *CAT_songs = NULL;
+static uint32_t            CAT_count = 0;
+static uint32_t            CAT_capacity = 0;
+static uint8_t            *CAT_fps = NULL;
+static uint32_t            CAT_fpCount = 0;
+static uint32_t            CAT_fpCapacity = 0;
+/* Index of every song by its path */
+static jwHashTable        *CAT_index = NULL;
+
+static void catalogClose(struct Catalog *cat)
+{
+    if(!cat->data)
+        return;
+#ifdef ENABLE_MMAP_INSTDB
+    if(cat->mapped)
+        munmap(cat->data, cat->size);
+    else
+#endif
+    free(cat->data);
+    cat->data = NULL;
+}
+
+static int catalogOpen(struct Catalog *cat, const char *path)
+{
+    FILE    *f;
+    long     fileSize;
+    size_t   left;
+
+    memset(cat, 0, sizeof(struct Catalog));
+
+    f = fopen(path, "rb");
+    if(!f)
+        return 0;
+
+    fseek(f, 0, SEEK_END);
+    fileSize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if(fileSize < CAT_HEAD_SIZE)
+    {
+        fclose(f);
+        return 0;
+    }
+
+    cat->size = (size_t)fileSize;
+
+#ifdef ENABLE_MMAP_INSTDB
+    {
+        int   fd = open(path, O_RDONLY);
+        void *data = MAP_FAILED;
+
+        if(fd >= 0)
+        {
+            data = mmap(NULL, cat->size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+        }
+
+        if(data != MAP_FAILED)
+        {
+            cat->data = (uint8_t *)data;
+            cat->mapped = 1;
+        }
+    }
+#endif
+
+    if(!cat->data)
+    {
+        cat->data = (uint8_t *)malloc(cat->size);
+        if(!cat->data || (fread(cat->data, 1, cat->size, f) != cat->size))
+        {
+            fclose(f);
+            catalogClose(cat);
+            return 0;
+        }
+    }
+    fclose(f);
+
+    if((memcmp(cat->data, CAT_MAGIC, 4) != 0) ||
+       ((cat->data[4] | (cat->data[5] << 8)) != CAT_VERSION) ||
+       ((cat->data[6] | (cat->data[7] << 8)) != INST_FP_SIZE))
+    {
+        catalogClose(cat);
+        return 0;
+    }
+
+    cat->songs     = readLE32buf(cat->data + 8);
+    cat->uses      = readLE32buf(cat->data + 12);
+    cat->pathsSize = readLE32buf(cat->data + 16);
+
+    /* Counts are checked by division, so huge ones of the broken file can't wrap around */
+    left = cat->size - CAT_HEAD_SIZE;
+    if(cat->songs > left / (CAT_SONG_SIZE + 4))
+        goto broken;
+    left -= (size_t)cat->songs * (CAT_SONG_SIZE + 4);
+    if(cat->uses > left / (INST_FP_SIZE + CAT_USE_SIZE))
+        goto broken;
+    left -= (size_t)cat->uses * (INST_FP_SIZE + CAT_USE_SIZE);
+    if(cat->pathsSize > left)
+        goto broken;
+    left -= cat->pathsSize;
+    if((cat->pathsSize > 0) && (cat->data[cat->size - left - 1] != 0))
+        goto broken;
+
+    cat->records      = cat->data + CAT_HEAD_SIZE;
+    cat->fps          = cat->records + (cat->songs * CAT_SONG_SIZE);
+    cat->byInstrument = cat->fps + (cat->uses * INST_FP_SIZE);
+    cat->byDuration   = cat->byInstrument + (cat->uses * CAT_USE_SIZE);
+    cat->paths        = (const char *)(cat->byDuration + (cat->songs * 4));
+    return 1;
+
+broken:
+    catalogClose(cat);
+    return 0;
+}
+
+/**
+ * @brief Reads the song stored in the catalog
+ * @param cat opened catalog
+ * @param i index of the song
+ * @param info summary of the song
+ * @param fpFirst index of the first instrument of the song
+ * @return path of the song, or NULL if record is broken
+ */
+static const char *catalogSong(const struct Catalog *cat, uint32_t i,
+                               struct Imf2MIDI_SongInfo *info, uint32_t *fpFirst)
+{
+    const uint8_t *r = cat->records + (i * CAT_SONG_SIZE);
+    uint32_t pathAt;
+    int c;
+
+    if(i >= cat->songs)
+        return NULL;
+
+    info->ticks   = readLE32buf(r + 4);
+    info->records = readLE32buf(r + 8);
+    for(c = 0; c < IMF2MID_CHANNELS; c++)
+        info->notes[c] = readLE32buf(r + 12 + (c * 4));
+    r += 12 + (IMF2MID_CHANNELS * 4);
+    *fpFirst          = readLE32buf(r);
+    info->instruments = readLE32buf(r + 4);
+    pathAt            = readLE32buf(r + 8);
+
+    if((pathAt >= cat->pathsSize) || (*fpFirst > cat->uses) ||
+       (info->instruments > cat->uses - *fpFirst))
+        return NULL;
+
+    return cat->paths + pathAt;
+}
+
+static void catalogReset(void)
+{
+    uint32_t i;
+
+    for(i = 0; i < CAT_count; i++)
+        free(CAT_songs[i].path);
+    if(CAT_songs)
+        free(CAT_songs);
+    if(CAT_fps)
+        free(CAT_fps);
+    if(CAT_index)
+        CAT_index = (jwHashTable *)delete_hash(CAT_index);
+    if(CAT_path)
+        free(CAT_path);
+
+    CAT_songs = NULL;
+    CAT_count = CAT_capacity = 0;
+    CAT_fps = NULL;
+    CAT_fpCount = CAT_fpCapacity = 0;
+    CAT_path = NULL;
+}
+
+static void catalogAddInstrument(const uint8_t *fp)
+{
+    if(CAT_fpCount >= CAT_fpCapacity)
+    {
+        uint32_t capacity = CAT_fpCapacity ? (CAT_fpCapacity * 2) : 1024;
+        uint8_t *fps = (uint8_t *)realloc(CAT_fps, (size_t)capacity * INST_FP_SIZE);
+        if(!fps)
+            return;
+        CAT_fps = fps;
+        CAT_fpCapacity = capacity;
+    }
+
+    memcpy(CAT_fps + (CAT_fpCount * INST_FP_SIZE), fp, INST_FP_SIZE);
+    CAT_fpCount++;
+}
+
+/**
+ * @brief Stores the song into the catalog being updated
+ * @param path path of the song
+ * @param hash content hash of the song
+ * @param info summary of the song
+ * @param fpFirst index of the first instrument of the song in CAT_fps
+ * @return 1 on success
+ */
+static int catalogPut(char *path, uint32_t hash, struct Imf2MIDI_SongInfo *info, uint32_t fpFirst)
+{
+    struct CatalogSong *song;
+    long i;
+
+    if(get_long_by_str(CAT_index, path, &i) == HASHOK)
+        song = &CAT_songs[i];
+    else
+    {
+        if(CAT_count >= CAT_capacity)
+        {
+            uint32_t capacity = CAT_capacity ? (CAT_capacity * 2) : 256;
+            song = (struct CatalogSong *)realloc(CAT_songs, capacity * sizeof(struct CatalogSong));
+            if(!song)
+                return 0;
+            CAT_songs = song;
+            CAT_capacity = capacity;
+        }
+
+        add_int_by_str(CAT_index, path, (long)CAT_count);
+        song = &CAT_songs[CAT_count++];
+        song->path = copystring(path);
+    }
+
+    /* Instruments of the previous version stay unused until the catalog is written */
+    song->hash    = hash;
+    song->info    = *info;
+    song->fpFirst = fpFirst;
+    return 1;
+}
+
+int Imf2MIDI_openCatalog(const char *path)
+{
+    struct Catalog cat;
+    struct Imf2MIDI_SongInfo info;
+    uint32_t i, j, fpFirst;
+    const char *songPath;
+
+    Imf2MIDI_closeCatalog();
+
+    CAT_index = create_hash(1024);
+    CAT_path = copystring((char *)path);
+    if(!CAT_index)
+        return 1;
+
+    if(!catalogOpen(&cat, path))
+    {
+        FILE *f = fopen(path, "rb");
+        if(f)
+        {
+            fclose(f);
+            logMessage(IMF2MID_LOG_WARN, "%s is not a valid catalog, it will be created again!\n\n", path);
+        }
+        return 0;
+    }
+
+    for(i = 0; i < cat.songs; i++)
+    {
+        songPath = catalogSong(&cat, i, &info, &fpFirst);
+        if(!songPath)
+            continue;
+        for(j = 0; j < info.instruments; j++)
+            catalogAddInstrument(cat.fps + ((fpFirst + j) * INST_FP_SIZE));
+        catalogPut((char *)songPath, readLE32buf(cat.records + (i * CAT_SONG_SIZE)),
+                   &info, CAT_fpCount - info.instruments);
+    }
+
+    catalogClose(&cat);
+    return 0;
+}
+
+int Imf2MIDI_catalogAdd(const char *path_in, int log)
+{
+    struct Imf2MIDI_SongInfo info;
+    uint8_t  chunk[512];
+    size_t   got;
+    uint32_t hash = 2166136261UL, fpFirst, imf_length;
+    long     i;
+    FILE    *file_in;
+
+    if(!CAT_index)
+        return 1;
+
+    logSetLevel(log);
+
+    file_in = fopen(path_in, "rb");
+    if(!file_in)
+    {
+        logMessage(IMF2MID_LOG_ERROR, "Can't open file %s for read!\n\n", path_in);
+        return 1;
+    }
+
+    while((got = fread(chunk, 1, sizeof(chunk), file_in)) > 0)
+        hash = fuzzyHashData(hash, chunk, got);
+
+    if((get_long_by_str(CAT_index, (char *)path_in, &i) == HASHOK) && (CAT_songs[i].hash == hash))
+    {
+        logMessage(IMF2MID_LOG_INFO, "\"%s\" is not changed\n", path_in);
+        fclose(file_in);
+        return 0;
+    }
+
+    fseek(file_in, 0, SEEK_SET);
+    setvbuf(file_in, NULL, _IONBF, 0);
+    imf_length = readLE32(file_in);
+    if(imf_length == 0)
+    {
+        logMessage(IMF2MID_LOG_ERROR, "Failed to read IMF length!\n\n");
+        fclose(file_in);
+        return 1;
+    }
+
+    logMessage(IMF2MID_LOG_INFO, "Scanning \"%s\"...\n", path_in);
+    fpFirst = CAT_fpCount;
+    scanSong(file_in, imf_length - 4, &info, catalogAddInstrument);
+    fclose(file_in);
+
+    /* Out of memory while collecting instruments */
+    if(CAT_fpCount - fpFirst != info.instruments)
+        return 1;
+
+    return catalogPut((char *)path_in, hash, &info, fpFirst) ? 0 : 1;
+}
+
+static int catalogHashCmp(const void *a, const void *b)
+{
+    const struct CatalogSong *s1 = &CAT_songs[*(const uint32_t *)a];
+    const struct CatalogSong *s2 = &CAT_songs[*(const uint32_t *)b];
+
+    if(s1->hash != s2->hash)
+        return (s1->hash < s2->hash) ? -1 : 1;
+    return strcmp(s1->path, s2->path);
+}
+
+/* Orders songs by the position in the file, songs are already sorted there */
+static const uint32_t *CAT_order = NULL;
+
+static int catalogDurationCmp(const void *a, const void *b)
+{
+    uint32_t i1 = *(const uint32_t *)a, i2 = *(const uint32_t *)b;
+    uint32_t t1 = CAT_songs[CAT_order[i1]].info.ticks;
+    uint32_t t2 = CAT_songs[CAT_order[i2]].info.ticks;
+
+    if(t1 != t2)
+        return (t1 < t2) ? -1 : 1;
+    return (i1 < i2) ? -1 : (i1 > i2);
+}
+
+static int catalogUseCmp(const void *a, const void *b)
+{
+    int cmp = memcmp(a, b, INST_FP_SIZE);
+    if(cmp != 0)
+        return cmp;
+    return memcmp((const uint8_t *)a + INST_FP_SIZE, (const uint8_t *)b + INST_FP_SIZE, 4);
+}
+
+/* Writes the index in big-endian, so the uses are sorted by song with memcmp */
+static void catalogPutUse(uint8_t *use, const uint8_t *fp, uint32_t song)
+{
+    memcpy(use, fp, INST_FP_SIZE);
+    use[INST_FP_SIZE + 0] = (uint8_t)(song >> 24);
+    use[INST_FP_SIZE + 1] = (uint8_t)(song >> 16);
+    use[INST_FP_SIZE + 2] = (uint8_t)(song >> 8);
+    use[INST_FP_SIZE + 3] = (uint8_t)song;
+}
+
+static int catalogWrite(const char *path)
+{
+    uint32_t *order, *byDuration;
+    uint8_t  *uses = NULL;
+    uint32_t  i, c, usesCount = 0, pathsSize = 0, fpAt = 0, pathAt = 0;
+    uint8_t   head[CAT_HEAD_SIZE];
+    char     *tmpPath;
+    FILE     *f;
+    int       res = 1;
+
+    order      = (uint32_t *)malloc((CAT_count + 1) * sizeof(uint32_t));
+    byDuration = (uint32_t *)malloc((CAT_count + 1) * sizeof(uint32_t));
+    tmpPath    = (char *)malloc(strlen(path) + 5);
+    if(!order || !byDuration || !tmpPath)
+        goto done;
+
+    for(i = 0; i < CAT_count; i++)
+    {
+        order[i] = i;
+        byDuration[i] = i;
+        usesCount += CAT_songs[i].info.instruments;
+        pathsSize += (uint32_t)strlen(CAT_songs[i].path) + 1;
+    }
+
+    qsort(order, CAT_count, sizeof(uint32_t), catalogHashCmp);
+    CAT_order = order;
+    qsort(byDuration, CAT_count, sizeof(uint32_t), catalogDurationCmp);
+
+    uses = (uint8_t *)malloc((usesCount + 1) * CAT_USE_SIZE);
+    if(!uses)
+        goto done;
+
+    for(i = 0; i < CAT_count; i++)
+    {
+        struct CatalogSong *s = &CAT_songs[order[i]];
+        for(c = 0; c < s->info.instruments; c++)
+            catalogPutUse(uses + ((fpAt + c) * CAT_USE_SIZE), CAT_fps + ((s->fpFirst + c) * INST_FP_SIZE), i);
+        fpAt += s->info.instruments;
+    }
+    qsort(uses, usesCount, CAT_USE_SIZE, catalogUseCmp);
+
+    /* Write into the temporary file to never leave the broken catalog */
+    sprintf(tmpPath, "%s.tmp", path);
+    f = fopen(tmpPath, "wb");
+    if(!f)
+    {
+        logMessage(IMF2MID_LOG_ERROR, "Can't open file %s for write!\n\n", tmpPath);
+        goto done;
+    }
+    setvbuf(f, NULL, _IONBF, 0);
+    fbeginb(f, 0);
+
+    memcpy(head, CAT_MAGIC, 4);
+    head[4] = CAT_VERSION & 0xFF;
+    head[5] = (CAT_VERSION >> 8) & 0xFF;
+    head[6] = INST_FP_SIZE;
+    head[7] = 0;
+    fwriteb((char *)head, 1, 8, f);
+    writeLE32(f, CAT_count);
+    writeLE32(f, usesCount);
+    writeLE32(f, pathsSize);
+
+    fpAt = 0;
+    for(i = 0; i < CAT_count; i++)
+    {
+        struct CatalogSong *s = &CAT_songs[order[i]];
+        writeLE32(f, s->hash);
+        writeLE32(f, s->info.ticks);
+        writeLE32(f, s->info.records);
+        for(c = 0; c < IMF2MID_CHANNELS; c++)
+            writeLE32(f, s->info.notes[c]);
+        writeLE32(f, fpAt);
+        writeLE32(f, s->info.instruments);
+        writeLE32(f, pathAt);
+        fpAt   += s->info.instruments;
+        pathAt += (uint32_t)strlen(s->path) + 1;
+    }
+
+    for(i = 0; i < CAT_count; i++)
+    {
+        struct CatalogSong *s = &CAT_songs[order[i]];
+        for(c = 0; c < s->info.instruments; c++)
+            fwriteb((char *)CAT_fps + ((s->fpFirst + c) * INST_FP_SIZE), 1, INST_FP_SIZE, f);
+    }
+
+    for(i = 0; i < usesCount; i++)
+    {
+        uint8_t *use = uses + (i * CAT_USE_SIZE);
+        fwriteb((char *)use, 1, INST_FP_SIZE, f);
+        writeLE32(f, ((uint32_t)use[INST_FP_SIZE] << 24) | ((uint32_t)use[INST_FP_SIZE + 1] << 16) |
+                     ((uint32_t)use[INST_FP_SIZE + 2] << 8) | (uint32_t)use[INST_FP_SIZE + 3]);
+    }
+
+    for(i = 0; i < CAT_count; i++)
+        writeLE32(f, byDuration[i]);
+
+    for(i = 0; i < CAT_count; i++)
+    {
+        char *p = CAT_songs[order[i]].path;
+        fwriteb(p, 1, strlen(p) + 1, f);
+    }
+
+    fflushb(f);
+    if(fclose(f) != 0)
+    {
+        logMessage(IMF2MID_LOG_ERROR, "Failed to write %s!\n\n", tmpPath);
+        remove(tmpPath);
+        goto done;
+    }
+
+    remove(path);
+    if(rename(tmpPath, path) != 0)
+    {
+        logMessage(IMF2MID_LOG_ERROR, "Can't rename %s into %s!\n\n", tmpPath, path);
+        goto done;
+    }
+
+    res = 0;
+
+done:
+    CAT_order = NULL;
+    if(order)
+        free(order);
+    if(byDuration)
+        free(byDuration);
+    if(uses)
+        free(uses);
+    if(tmpPath)
+        free(tmpPath);
+    return res;
+}
+
+int Imf2MIDI_closeCatalog(void)
+{
+    int res = 0;
+
+    if(!CAT_path)
+        return 0;
+
+    if(CAT_index)
+        res = catalogWrite(CAT_path);
+
+    catalogReset();
+    return res;
+}
+
+int Imf2MIDI_catalogFindInstrument(const char *path_catalog, const char *fingerprint,
+                                   Imf2MIDI_SongFound found, void *userData)
+{
+    struct Catalog cat;
+    struct Imf2MIDI_SongInfo info;
+    uint8_t  fp[INST_FP_SIZE];
+    uint32_t lo = 0, hi, fpFirst;
+    const char *path;
+
+    if((strlen(fingerprint) != INST_FP_SIZE * 2) || !fuzzyParseKey(fingerprint, fp))
+    {
+        logMessage(IMF2MID_LOG_ERROR, "Instrument must be given as %d hex digits!\n\n", INST_FP_SIZE * 2);
+        return 1;
+    }
+
+    if(!catalogOpen(&cat, path_catalog))
+    {
+        logMessage(IMF2MID_LOG_ERROR, "Can't open catalog %s!\n\n", path_catalog);
+        return 1;
+    }
+
+    /* The first use of the instrument */
+    hi = cat.uses;
+    while(lo < hi)
+    {
+        uint32_t mid = lo + ((hi - lo) / 2);
+        if(memcmp(cat.byInstrument + (mid * CAT_USE_SIZE), fp, INST_FP_SIZE) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for(; lo < cat.uses; lo++)
+    {
+        const uint8_t *use = cat.byInstrument + (lo * CAT_USE_SIZE);
+        if(memcmp(use, fp, INST_FP_SIZE) != 0)
+            break;
+        path = catalogSong(&cat, readLE32buf(use + INST_FP_SIZE), &info, &fpFirst);
+        if(path)
+            found(path, &info, userData);
+    }
+
+    catalogClose(&cat);
+    return 0;
+}
+
+int Imf2MIDI_catalogFindDuration(const char *path_catalog, uint32_t minTicks, uint32_t maxTicks,
+                                 Imf2MIDI_SongFound found, void *userData)
+{
+    struct Catalog cat;
+    struct Imf2MIDI_SongInfo info;
+    uint32_t lo = 0, hi, fpFirst;
+    const char *path;
+
+    if(!catalogOpen(&cat, path_catalog))
+    {
+        logMessage(IMF2MID_LOG_ERROR, "Can't open catalog %s!\n\n", path_catalog);
+        return 1;
+    }
+
+    /* The first song which is not shorter than minimum */
+    hi = cat.songs;
+    while(lo < hi)
+    {
+        uint32_t mid = lo + ((hi - lo) / 2);
+        uint32_t song = readLE32buf(cat.byDuration + (mid * 4));
+        if(song >= cat.songs)
+            break;
+        if(readLE32buf(cat.records + (song * CAT_SONG_SIZE) + 4) < minTicks)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for(; lo < cat.songs; lo++)
+    {
+        path = catalogSong(&cat, readLE32buf(cat.byDuration + (lo * 4)), &info, &fpFirst);
+        if(!path)
+            continue;
+        if(info.ticks > maxTicks)
+            break;
+        found(path, &info, userData);
+    }
+
+    catalogClose(&cat);
+    return 0;
+}
+/*****************************************************************/
+
+
+/*****************************************************************
+ *                          Song state                           *
+ *****************************************************************/
+
+#if IMF2MID_CHANNELS > 32
+#error "Bit set of dirty channels is too small"
+#endif
+#define IMF_CHANNELS_ALL    (0xFFFFFFFFUL >> (32 - IMF2MID_CHANNELS))
+
+/*
+ * Everything the conversion keeps between two IMF records besides the
+ * instruments and MIDI writer state stored in the converter context.
+ */
+struct SongState
+{
+    uint16_t imf_freq[IMF2MID_CHANNELS];
+    uint8_t  imf_octs[IMF2MID_CHANNELS];
+    uint8_t  imf_key_st[IMF2MID_CHANNELS];
+    uint8_t  imf_key_st_prev[IMF2MID_CHANNELS];
+    /* Array of pressed keys which allows to mute a pitched or toggled notes without powering off */
+    uint8_t  imf_keys[IMF2MID_CHANNELS];
+    uint8_t  imf_keys_prev[IMF2MID_CHANNELS];
+    uint16_t imf_pitchs[IMF2MID_CHANNELS];
+    uint16_t imf_pitchs_prev[IMF2MID_CHANNELS];
+    uint8_t  imf_insChange[IMF2MID_CHANNELS];
+    uint8_t  imf_channel;
+    /* Channels whose note may have changed since the last delay, bit per channel */
+    uint32_t imf_dirty;
+    /* Time of the next record in ticks */
+    uint32_t tick;
+};
+
+static void songStateReset(struct SongState *st)
+{
+    uint8_t c;
+
+    memset(st, 0, sizeof(struct SongState));
+    st->imf_dirty = IMF_CHANNELS_ALL;
+    for(c = 0; c < IMF2MID_CHANNELS; c++)
+    {
+        st->imf_pitchs[c]      = MIDI_PITCH_CENTER;
+        st->imf_pitchs_prev[c] = MIDI_PITCH_CENTER;
+    }
+}
+/*****************************************************************/
+
+
+/*****************************************************************
+ *                   MIDI channel allocation                     *
+ *****************************************************************/
+
+/*
+ * Instead of the fixed MIDI channel of every IMF channel, every note gets
+ * one of 15 MIDI channels (all except of drums) chosen by its patch. Notes
+ * of the same patch share the channel, so patch changes are written only
+ * when all channels are taken by other patches. Channel is shared only
+ * with other keys of the same pitch bend, but later bends of one note
+ * apply to all notes of the channel.
+ */
+
+/**
+ * @brief Chooses the MIDI channel for the note of IMF channel and prepares it
+ * @param f output file
+ * @param cvt converter context
+ * @param st song state, previous notes of other channels are still sounding
+ * @param channel IMF channel of the note
+ */
+static void MIDI_allocChannel(FILE *f, struct Imf2MIDI_CVT *cvt, const struct SongState *st, uint8_t channel)
+{
+    uint8_t  patch = cvt->midi_voicePatch[channel];
+    uint16_t pitch = cvt->flag_usePitch ? st->imf_pitchs[channel] : MIDI_PITCH_CENTER;
+    uint8_t  best = cvt->midi_mapchannel[channel];
+    int      bestRank = 4;
+    uint8_t  ch, c;
+
+    for(ch = 0; ch < IMF2MID_MIDI_CHANNELS; ch++)
+    {
+        int busy = 0, sameKey = 0, rank;
+
+        if(ch == MIDI_DRUM_CHANNEL)
+            continue;
+
+        for(c = 0; c < IMF2MID_CHANNELS; c++)
+        {
+            if((c != channel) && (st->imf_keys_prev[c] != 0) && (cvt->midi_mapchannel[c] == ch))
+            {
+                busy = 1;
+                /* Note-off of one of them would stop both */
+                if(st->imf_keys_prev[c] == st->imf_keys[channel])
+                    sameKey = 1;
+            }
+        }
+
+        if((cvt->midi_lastpatch[ch] == patch) && !sameKey && (!busy || (cvt->midi_lastpitch[ch] == pitch)))
+            rank = (ch == cvt->midi_mapchannel[channel]) ? 0 : 1; /* Same patch */
+        else if(busy)
+            continue;
+        else if(cvt->midi_lastpatch[ch] == MIDI_PATCH_NONE)
+            rank = 2; /* Never used */
+        else
+            rank = 3; /* Least recently used */
+
+        if((rank < bestRank) ||
+           ((rank == 3) && (bestRank == 3) && (cvt->midi_channelUsed[ch] < cvt->midi_channelUsed[best])))
+        {
+            best = ch;
+            bestRank = rank;
+        }
+    }
+
+    cvt->midi_mapchannel[channel] = best;
+    cvt->midi_channelUsed[best] = st->tick;
+
+    if((patch != MIDI_PATCH_NONE) && (cvt->midi_lastpatch[best] != patch))
+        MIDI_writePatchChangeEvent(f, cvt, best, patch);
+
+    if(cvt->flag_usePitch)
+        MIDI_writePitchEvent(f, cvt, best, pitch);
+}
+/*****************************************************************/
+
+
+/*****************************************************************
+ *                          Seek index                           *
+ *****************************************************************/
+
+/*
+ * Seek index (song name with ".seek" suffix) keeps the state of the
+ * conversion taken at regular intervals of song time, so a part of the
+ * long song gets converted without walking it from the begin. Format of
+ * the file (all integers are little-endian):
+ *   char[4]     magic "I2MS"
+ *   uint16      format version
+ *   uint16      size of checkpoint
+ *   uint32      hash of the song (same as the update mode uses)
+ *   uint32      interval of checkpoints in ticks
+ *   uint32      count of checkpoints
+ *   checkpoints sorted by time:
+ *     uint32    index of the next IMF record
+ *     uint32    time of the next IMF record in ticks
+ *     ...       song state, instruments, MIDI channels of IMF channels
+ *               and state of every MIDI channel with its sounding keys
+ *     uint32    offset of the instrument state after the last checkpoint
+ *     uint32    size of the instrument state
+ *   instrument states of checkpoints:
+ *     uint32    count of random patches chosen since the begin of song
+ *     uint16    count of instruments of the song, and for each of them:
+ *               uint8[10] key, uint8 patch (0xFF when not detected yet)
+ *               and uint8 carrier level the patch was detected for
+ *     uint32    count of learned patches, and for each of them:
+ *               uint8[11] fingerprint, uint8 patch
+ * Every checkpoint is taken before the record with the delay, so the
+ * conversion continued from it matches the conversion of whole song.
+ */
+#define SEEK_MAGIC          "I2MS"
+#define SEEK_VERSION        4
+#define SEEK_HEAD_SIZE      20
+#define SEEK_INST_SIZE      12
+#define SEEK_POINT_SIZE     (8 + (IMF2MID_CHANNELS * (12 + (2 * SEEK_INST_SIZE) + 2)) + 1 + \
+                             (IMF2MID_MIDI_CHANNELS * (7 + 16)))
+#define SEEK_ENTRY_SIZE     (SEEK_POINT_SIZE + 8)
+/* About 10 seconds at the default tempo */
+#define SEEK_INTERVAL       7040
+
+static uint8_t  *SEEK_points = NULL;
+static uint32_t  SEEK_count = 0;
+static uint32_t  SEEK_capacity = 0;
+static uint32_t  SEEK_next = 0;
+static uint8_t  *SEEK_states = NULL;
+static uint32_t  SEEK_statesSize = 0;
+static uint32_t  SEEK_statesCapacity = 0;
+/* Count of random patches chosen before the song */
+static uint32_t  SEEK_randBase = 0;
+
+static uint8_t *seekPackInst(uint8_t *p, const struct AdLibInstrument *in)
+{
+    *p++ = in->reg20[0]; *p++ = in->reg20[1];
+    *p++ = in->reg40[0]; *p++ = in->reg40[1];
+    *p++ = in->reg60[0]; *p++ = in->reg60[1];
+    *p++ = in->reg80[0]; *p++ = in->reg80[1];
+    *p++ = in->regC0;
+    *p++ = in->regE0[0]; *p++ = in->regE0[1];
+    *p++ = in->patch;
+    return p;
+}
+
+static const uint8_t *seekUnpackInst(const uint8_t *p, struct AdLibInstrument *in)
+{
+    in->reg20[0] = *p++; in->reg20[1] = *p++;
+    in->reg40[0] = *p++; in->reg40[1] = *p++;
+    in->reg60[0] = *p++; in->reg60[1] = *p++;
+    in->reg80[0] = *p++; in->reg80[1] = *p++;
+    in->regC0    = *p++;
+    in->regE0[0] = *p++; in->regE0[1] = *p++;
+    in->patch    = *p++;
+    return p;
+}
+
+static uint8_t *seekPack16(uint8_t *p, const uint16_t *in, size_t count)
+{
+    size_t i;
+    for(i = 0; i < count; i++)
+    {
+        *p++ = (uint8_t)(in[i] & 0xFF);
+        *p++ = (uint8_t)((in[i] >> 8) & 0xFF);
+    }
+    return p;
+}
+
+static const uint8_t *seekUnpack16(const uint8_t *p, uint16_t *out, size_t count)
+{
+    size_t i;
+    for(i = 0; i < count; i++, p += 2)
+        out[i] = (uint16_t)(p[0] | (p[1] << 8));
+    return p;
+}
+
+static uint8_t *seekPack32(uint8_t *p, uint32_t in)
+{
+    p[0] = (uint8_t)(in & 0xFF);
+    p[1] = (uint8_t)((in >> 8) & 0xFF);
+    p[2] = (uint8_t)((in >> 16) & 0xFF);
+    p[3] = (uint8_t)((in >> 24) & 0xFF);
+    return p + 4;
+}
+
+/**
+ * @brief Stores the state of the conversion
+ * @param p buffer of SEEK_POINT_SIZE bytes
+ * @param cvt converter context
+ * @param st song state
+ * @param record index of the next IMF record
+ */
+static void seekPack(uint8_t *p, const struct Imf2MIDI_CVT *cvt, const struct SongState *st, uint32_t record)
+{
+    uint8_t c;
+
+    p = seekPack32(p, record);
+    p = seekPack32(p, st->tick);
+    p = seekPack16(p, st->imf_freq, IMF2MID_CHANNELS);
+    memcpy(p, st->imf_octs, IMF2MID_CHANNELS);         p += IMF2MID_CHANNELS;
+    memcpy(p, st->imf_key_st, IMF2MID_CHANNELS);       p += IMF2MID_CHANNELS;
+    memcpy(p, st->imf_key_st_prev, IMF2MID_CHANNELS);  p += IMF2MID_CHANNELS;
+    memcpy(p, st->imf_keys, IMF2MID_CHANNELS);         p += IMF2MID_CHANNELS;
+    memcpy(p, st->imf_keys_prev, IMF2MID_CHANNELS);    p += IMF2MID_CHANNELS;
+    p = seekPack16(p, st->imf_pitchs, IMF2MID_CHANNELS);
+    p = seekPack16(p, st->imf_pitchs_prev, IMF2MID_CHANNELS);
+    memcpy(p, st->imf_insChange, IMF2MID_CHANNELS);    p += IMF2MID_CHANNELS;
+    *p++ = st->imf_channel;
+
+    for(c = 0; c < IMF2MID_CHANNELS; c++)
+        p = seekPackInst(p, &cvt->imf_instruments[c]);
+    for(c = 0; c < IMF2MID_CHANNELS; c++)
+        p = seekPackInst(p, &cvt->imf_instrumentsPrev[c]);
+
+    memcpy(p, cvt->midi_mapchannel, IMF2MID_CHANNELS);  p += IMF2MID_CHANNELS;
+    memcpy(p, cvt->midi_voicePatch, IMF2MID_CHANNELS);  p += IMF2MID_CHANNELS;
+
+    for(c = 0; c < IMF2MID_MIDI_CHANNELS; c++)
+    {
+        *p++ = (uint8_t)cvt->midi_lastpatch[c];
+        p = seekPack32(p, cvt->midi_channelUsed[c]);
+    }
+    p = seekPack16(p, cvt->midi_lastpitch, IMF2MID_MIDI_CHANNELS);
+    memcpy(p, cvt->midi_keysOn, sizeof(cvt->midi_keysOn));
+}
+
+/**
+ * @brief Restores the state of the conversion
+ * @param p buffer of SEEK_POINT_SIZE bytes
+ * @param cvt converter context
+ * @param st song state
+ * @return index of the next IMF record
+ */
+static uint32_t seekUnpack(const uint8_t *p, struct Imf2MIDI_CVT *cvt, struct SongState *st)
+{
+    uint32_t record = readLE32buf(p);
+    uint8_t c;
+
+    st->tick = readLE32buf(p + 4);
+    p += 8;
+    p = seekUnpack16(p, st->imf_freq, IMF2MID_CHANNELS);
+    memcpy(st->imf_octs, p, IMF2MID_CHANNELS);         p += IMF2MID_CHANNELS;
+    memcpy(st->imf_key_st, p, IMF2MID_CHANNELS);       p += IMF2MID_CHANNELS;
+    memcpy(st->imf_key_st_prev, p, IMF2MID_CHANNELS);  p += IMF2MID_CHANNELS;
+    memcpy(st->imf_keys, p, IMF2MID_CHANNELS);         p += IMF2MID_CHANNELS;
+    memcpy(st->imf_keys_prev, p, IMF2MID_CHANNELS);    p += IMF2MID_CHANNELS;
+    p = seekUnpack16(p, st->imf_pitchs, IMF2MID_CHANNELS);
+    p = seekUnpack16(p, st->imf_pitchs_prev, IMF2MID_CHANNELS);
+    memcpy(st->imf_insChange, p, IMF2MID_CHANNELS);    p += IMF2MID_CHANNELS;
+    st->imf_channel = *p++ % IMF2MID_CHANNELS;
+    st->imf_dirty = IMF_CHANNELS_ALL;
+
+    for(c = 0; c < IMF2MID_CHANNELS; c++)
+        p = seekUnpackInst(p, &cvt->imf_instruments[c]);
+    for(c = 0; c < IMF2MID_CHANNELS; c++)
+        p = seekUnpackInst(p, &cvt->imf_instrumentsPrev[c]);
+
+    for(c = 0; c < IMF2MID_CHANNELS; c++)
+        cvt->midi_mapchannel[c] = *p++ % IMF2MID_MIDI_CHANNELS;
+    memcpy(cvt->midi_voicePatch, p, IMF2MID_CHANNELS);  p += IMF2MID_CHANNELS;
+
+    for(c = 0; c < IMF2MID_MIDI_CHANNELS; c++)
+    {
+        cvt->midi_lastpatch[c] = *p++;
+        cvt->midi_channelUsed[c] = readLE32buf(p);
+        p += 4;
+    }
+    p = seekUnpack16(p, cvt->midi_lastpitch, IMF2MID_MIDI_CHANNELS);
+    memcpy(cvt->midi_keysOn, p, sizeof(cvt->midi_keysOn));
+
+    return record;
+}
+
+static uint32_t seekCountLearned(void)
+{
+    uint32_t learned = 0;
+    unsigned long b;
+
+    for(b = 0; INST_learned && (b < INST_learned->buckets); b++)
+    {
+        jwHashEntry *entry;
+        for(entry = INST_learned->bucket[b]; entry; entry = entry->next)
+            learned++;
+    }
+
+    return learned;
+}
+
+/* Size of the instrument state: random patches, instruments of the song and learned patches */
+static uint32_t seekInstStateSize(void)
+{
+    return 4 + 2 + (INST_cacheCount * (INST_KEY_SIZE + 2)) + 4 + (seekCountLearned() * (INST_FP_SIZE + 1));
+}
+
+/**
+ * @brief Stores instruments of the song and patches chosen for them
+ * @param p buffer of seekInstStateSize() bytes
+ * @param randBase count of random patches which is stored as zero
+ * @return end of the stored state
+ */
+static uint8_t *seekPackInstState(uint8_t *p, uint32_t randBase)
+{
+    unsigned long b;
+    uint16_t i;
+
+    p = seekPack32(p, INST_randCount - randBase);
+
+    *p++ = (uint8_t)(INST_cacheCount & 0xFF);
+    *p++ = (uint8_t)((INST_cacheCount >> 8) & 0xFF);
+    for(i = 0; i < INST_cacheCount; i++)
+    {
+        memcpy(p, INST_cache[i].key, INST_KEY_SIZE);
+        p += INST_KEY_SIZE;
+        *p++ = (INST_cache[i].patch < 0) ? 0xFF : (uint8_t)INST_cache[i].patch;
+        *p++ = INST_cache[i].level;
+    }
+
+    p = seekPack32(p, seekCountLearned());
+    for(b = 0; INST_learned && (b < INST_learned->buckets); b++)
+    {
+        jwHashEntry *entry;
+        for(entry = INST_learned->bucket[b]; entry; entry = entry->next)
+        {
+            if(!fuzzyParseKey(entry->key.strValue, p))
+                memset(p, 0, INST_FP_SIZE);
+            p += INST_FP_SIZE;
+            *p++ = (uint8_t)entry->value.intValue;
+        }
+    }
+
+    return p;
+}
+
+/* Checks the lists of the instrument state, gives its size or 0 if it's broken */
+static size_t seekCheckInstState(const uint8_t *p, size_t size)
+{
+    size_t   at = 4;
+    uint32_t count;
+
+    if(size < at + 2)
+        return 0;
+    count = (uint32_t)(p[at] | (p[at + 1] << 8));
+    if(count > INST_CACHE_SIZE)
+        return 0;
+    at += 2 + (count * (INST_KEY_SIZE + 2));
+    if(at + 4 > size)
+        return 0;
+
+    count = readLE32buf(p + at);
+    at += 4;
+    if(count > (size - at) / (INST_FP_SIZE + 1))
+        return 0;
+
+    return at + (count * (INST_FP_SIZE + 1));
+}
+
+/**
+ * @brief Restores instruments of the song and patches chosen for them
+ * @param p state checked by seekCheckInstState()
+ * @param randBase count of random patches which is stored as zero
+ */
+static void seekUnpackInstState(const uint8_t *p, uint32_t randBase)
+{
+    struct AdLibInstrument inst;
+    uint32_t count, i, randCount;
+    char     key[INST_FP_SIZE * 2 + 1];
+
+    randCount = randBase + readLE32buf(p);
+    p += 4;
+
+    /* Same order of instruments gives them the same IDs */
+    instCacheReset();
+    count = (uint32_t)(p[0] | (p[1] << 8));
+    p += 2;
+    for(i = 0; i < count; i++, p += INST_KEY_SIZE + 2)
+    {
+        uint16_t id;
+        memset(&inst, 0, sizeof(inst));
+        inst.reg20[0] = p[0];
+        inst.reg20[1] = p[1];
+        inst.reg40[0] = p[2];
+        inst.reg60[0] = p[3];
+        inst.reg60[1] = p[4];
+        inst.reg80[0] = p[5];
+        inst.reg80[1] = p[6];
+        inst.regC0    = p[7];
+        inst.regE0[0] = p[8];
+        inst.regE0[1] = p[9];
+        id = instIntern(&inst);
+        if(id != INST_NONE)
+        {
+            INST_cache[id].patch = (p[INST_KEY_SIZE] == 0xFF) ? -1 : (int16_t)p[INST_KEY_SIZE];
+            INST_cache[id].level = p[INST_KEY_SIZE + 1];
+        }
+    }
+
+    count = readLE32buf(p);
+    p += 4;
+    if(!INST_learned && (count > 0))
+        INST_learned = create_hash(256);
+    for(i = 0; INST_learned && (i < count); i++, p += INST_FP_SIZE + 1)
+    {
+        instKeyString(p, key);
+        add_int_by_str(INST_learned, key, (long)p[INST_FP_SIZE]);
+    }
+
+    /* Skip random numbers taken before the state was stored */
+    while(INST_randCount < randCount)
+    {
+        rand();
+        INST_randCount++;
+    }
+}
+
+static void seekReset(void)
+{
+    if(SEEK_points)
+        free(SEEK_points);
+    if(SEEK_states)
+        free(SEEK_states);
+    SEEK_points = NULL;
+    SEEK_states = NULL;
+    SEEK_count = SEEK_capacity = 0;
+    SEEK_statesSize = SEEK_statesCapacity = 0;
+    SEEK_next = 0;
+}
+
+/* Takes the checkpoint when the time has come */
+static void seekAddPoint(const struct Imf2MIDI_CVT *cvt, const struct SongState *st, uint32_t record)
+{
+    uint32_t stateSize;
+    uint8_t *entry;
+
+    if(st->tick < SEEK_next)
+        return;
+
+    if(SEEK_count >= SEEK_capacity)
+    {
+        uint32_t capacity = SEEK_capacity ? (SEEK_capacity * 2) : 64;
+        uint8_t *points = (uint8_t *)realloc(SEEK_points, (size_t)capacity * SEEK_ENTRY_SIZE);
+        if(!points)
+            return;
+        SEEK_points = points;
+        SEEK_capacity = capacity;
+    }
+
+    stateSize = seekInstStateSize();
+    if(SEEK_statesSize + stateSize > SEEK_statesCapacity)
+    {
+        uint32_t capacity = SEEK_statesCapacity ? SEEK_statesCapacity : 4096;
+        uint8_t *states;
+        while(SEEK_statesSize + stateSize > capacity)
+            capacity *= 2;
+        states = (uint8_t *)realloc(SEEK_states, capacity);
+        if(!states)
+            return;
+        SEEK_states = states;
+        SEEK_statesCapacity = capacity;
+    }
+
+    entry = SEEK_points + ((size_t)SEEK_count * SEEK_ENTRY_SIZE);
+    seekPack(entry, cvt, st, record);
+    seekPack32(entry + SEEK_POINT_SIZE, SEEK_statesSize);
+    seekPack32(entry + SEEK_POINT_SIZE + 4, stateSize);
+    seekPackInstState(SEEK_states + SEEK_statesSize, SEEK_randBase);
+    SEEK_statesSize += stateSize;
+    SEEK_count++;
+
+    while(SEEK_next <= st->tick)
+        SEEK_next += SEEK_INTERVAL;
+}
+
+static char *seekIndexPath(const char *path_in)
+{
+    char *path = (char *)malloc(strlen(path_in) + 6);
+    if(path)
+        sprintf(path, "%s.seek", path_in);
+    return path;
+}
+
+static void seekWrite(const char *path_in, uint32_t hash)
+{
+    uint8_t head[SEEK_HEAD_SIZE];
+    char   *path = seekIndexPath(path_in);
+    FILE   *f;
+
+    if(!path)
+        return;
+
+    f = fopen(path, "wb");
+    if(!f)
+    {
+        logMessage(IMF2MID_LOG_WARN, "Can't open file %s for write!\n\n", path);
+        free(path);
+        return;
+    }
+
+    memcpy(head, SEEK_MAGIC, 4);
+    head[4] = SEEK_VERSION & 0xFF;
+    head[5] = (SEEK_VERSION >> 8) & 0xFF;
+    head[6] = SEEK_ENTRY_SIZE & 0xFF;
+    head[7] = (SEEK_ENTRY_SIZE >> 8) & 0xFF;
+    seekPack32(head + 8, hash);
+    seekPack32(head + 12, SEEK_INTERVAL);
+    seekPack32(head + 16, SEEK_count);
+
+    fwrite(head, 1, SEEK_HEAD_SIZE, f);
+    if(SEEK_count > 0)
+    {
+        fwrite(SEEK_points, SEEK_ENTRY_SIZE, SEEK_count, f);
+        fwrite(SEEK_states, 1, SEEK_statesSize, f);
+    }
+    fclose(f);
+
+    logMessage(IMF2MID_LOG_INFO, "-- Written seek index \"%s\" (%lu points) --\n", path, (unsigned long)SEEK_count);
+    free(path);
+}
+
+/**
+ * @brief Finds the latest checkpoint of the seek index before given time
+ * @param cvt converter context, its state will be restored from the checkpoint
+ * @param hash hash of the song
+ * @param tick time to seek
+ * @param st song state to restore
+ * @param record index of the next IMF record
+ * @return 1 if checkpoint was found
+ */
+static int seekFind(struct Imf2MIDI_CVT *cvt, uint32_t hash, uint32_t tick,
+                    struct SongState *st, uint32_t *record)
+{
+    uint8_t  head[SEEK_HEAD_SIZE];
+    uint8_t  point[SEEK_ENTRY_SIZE];
+    uint8_t *state;
+    uint32_t lo = 0, hi, count, stateAt, stateSize;
+    char    *path = seekIndexPath(cvt->path_in);
+    FILE    *f;
+
+    if(!path)
+        return 0;
+    f = fopen(path, "rb");
+    free(path);
+    if(!f)
+        return 0;
+
+    if((fread(head, 1, SEEK_HEAD_SIZE, f) != SEEK_HEAD_SIZE) ||
+       (memcmp(head, SEEK_MAGIC, 4) != 0) ||
+       ((head[4] | (head[5] << 8)) != SEEK_VERSION) ||
+       ((head[6] | (head[7] << 8)) != SEEK_ENTRY_SIZE) ||
+       (readLE32buf(head + 8) != hash))
+    {
+        logMessage(IMF2MID_LOG_INFO, "-- Seek index is outdated, converting from the begin --\n");
+        fclose(f);
+        return 0;
+    }
+
+    /* The first checkpoint after given time */
+    count = readLE32buf(head + 16);
+    hi = count;
+    while(lo < hi)
+    {
+        uint32_t mid = lo + ((hi - lo) / 2);
+        fseek(f, (long)(SEEK_HEAD_SIZE + (mid * SEEK_ENTRY_SIZE)), SEEK_SET);
+        if(fread(point, 1, 8, f) != 8)
+            break;
+        if(readLE32buf(point + 4) <= tick)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if(lo == 0)
+    {
+        fclose(f);
+        return 0;
+    }
+
+    fseek(f, (long)(SEEK_HEAD_SIZE + ((lo - 1) * SEEK_ENTRY_SIZE)), SEEK_SET);
+    if(fread(point, 1, SEEK_ENTRY_SIZE, f) != SEEK_ENTRY_SIZE)
+    {
+        fclose(f);
+        return 0;
+    }
+
+    /* Instruments and their patches are needed to continue with the same patches */
+    stateAt   = readLE32buf(point + SEEK_POINT_SIZE);
+    stateSize = readLE32buf(point + SEEK_POINT_SIZE + 4);
+    state = (stateSize <= 0x100000UL) ? (uint8_t *)malloc(stateSize + 1) : NULL;
+    if(!state ||
+       (fseek(f, (long)(SEEK_HEAD_SIZE + (count * SEEK_ENTRY_SIZE) + stateAt), SEEK_SET) != 0) ||
+       (fread(state, 1, stateSize, f) != stateSize) ||
+       (seekCheckInstState(state, stateSize) != stateSize))
+    {
+        logMessage(IMF2MID_LOG_INFO, "-- Seek index is broken, converting from the begin --\n");
+        if(state)
+            free(state);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+
+    *record = seekUnpack(point, cvt, st);
+    seekUnpackInstState(state, SEEK_randBase);
+    free(state);
+    return 1;
+}
+
+/* Sets all channels into the state they have at the begin of the range */
+static void MIDI_writeRangeBegin(FILE *f, struct Imf2MIDI_CVT *cvt, struct SongState *st)
+{
+    uint8_t c, ch;
+
+    BUF_mute = 0;
+    cvt->midi_delta = 0;
+    cvt->midi_eventCode = -1;
+    /* Nothing sounds in the file yet */
+    MIDI_queueCount = 0;
+    memset(cvt->midi_keysOn, 0, sizeof(cvt->midi_keysOn));
+
+    for(ch = 0; ch < IMF2MID_MIDI_CHANNELS; ch++)
+    {
+        if(cvt->midi_lastpatch[ch] != MIDI_PATCH_NONE)
+            MIDI_writePatchChangeEvent(f, cvt, ch, (uint8_t)cvt->midi_lastpatch[ch]);
+
+        if(cvt->flag_usePitch && (cvt->midi_lastpitch[ch] != MIDI_PITCH_CENTER))
+        {
+            uint16_t pitch = cvt->midi_lastpitch[ch];
+            cvt->midi_lastpitch[ch] = MIDI_PITCH_CENTER;
+            MIDI_writePitchEvent(f, cvt, ch, pitch);
+        }
+
+        for(c = 0; c < IMF2MID_CHANNELS; c++)
+        {
+            uint8_t velLevel = cvt->imf_instruments[c].reg40[0] & 0x3F;
+
+            if((cvt->midi_mapchannel[c] != ch) || (st->imf_keys_prev[c] == 0))
+                continue;
+
+            if(velLevel > (cvt->imf_instruments[c].reg40[1] & 0x3F))
+                velLevel = cvt->imf_instruments[c].reg40[1] & 0x3F;
+            MIDI_writeNoteOnEvent(f, cvt, ch, st->imf_keys_prev[c], ((0x3f - velLevel) << 1) & 0xFF);
+        }
     }
 }
 /*****************************************************************/
 
 
 /*****************************************************************
- *                      Helper functions                         *
+ *                     Resumable conversion                      *
  *****************************************************************/
-static void makePitch(/*FILE* f*/uint16_t *pitchs, /*struct Imf2MIDI_CVT *cvt,*/ int16_t freq, uint8_t channel)
+
+/*
+ * Resumable conversion keeps the snapshot of its state next to the MIDI
+ * file (its name with ".ckpt" suffix), so conversion of a very long song
+ * interrupted by any reason continues from the last snapshot in the
+ * next run, appending to the already written part of the MIDI file.
+ * Format of the snapshot (all integers are little-endian):
+ *   char[4]     magic "I2MR"
+ *   uint16      format version
+ *   uint16      size of the song state
+ *   uint32      hash of the song (same as the update mode uses)
+ *   ...         song state, same as a checkpoint of the seek index
+ *   uint32[7]   MIDI writer: running status, pending delta, size of
+ *               written data, begin of the track, count of tracks, time
+ *               and the end of track flag
+ *   uint16[9]   IDs of previous instruments of IMF channels
+ *   uint32      count of random patches chosen before
+ *   uint16      count of instruments of the song, and for each of them:
+ *               uint8[10] key, uint8 patch (0xFF when not detected yet)
+ *               and uint8 carrier level the patch was detected for
+ *   uint32      count of learned patches, and for each of them:
+ *               uint8[11] fingerprint, uint8 patch
+ * The snapshot is taken before the record with delay, same as seek index
+ * checkpoints. Random patches are chosen again in the same order, so
+ * continued conversion gives the same MIDI file as uninterrupted one.
+ */
+#define RESUME_MAGIC        "I2MR"
+#define RESUME_VERSION      4
+#define RESUME_HEAD_SIZE    12
+#define RESUME_FIXED_SIZE   (RESUME_HEAD_SIZE + SEEK_POINT_SIZE + 28 + (IMF2MID_CHANNELS * 2) + 4)
+/* About one minute at the default tempo */
+#define RESUME_INTERVAL     (SEEK_INTERVAL * 6)
+
+static char *resumePath(const char *path_out)
+{
+    char *path = (char *)malloc(strlen(path_out) + 6);
+    if(path)
+        sprintf(path, "%s.ckpt", path_out);
+    return path;
+}
+
+/**
+ * @brief Makes the snapshot of the conversion
+ * @param hash hash of the song
+ * @param cvt converter context
+ * @param st song state
+ * @param record index of the next IMF record
+ * @param instIdPrev IDs of previous instruments of IMF channels
+ * @param size size of the snapshot
+ * @return snapshot which must be freed, or NULL when out of memory
+ */
+static uint8_t *resumePack(uint32_t hash, const struct Imf2MIDI_CVT *cvt,
+                           const struct SongState *st, uint32_t record,
+                           const uint16_t *instIdPrev, uint32_t *size)
+{
+    uint8_t *blob, *p;
+
+    /* Count of random patches of the instrument state is a part of the fixed size */
+    *size = RESUME_FIXED_SIZE - 4 + seekInstStateSize();
+    blob = (uint8_t *)malloc(*size);
+    if(!blob)
+        return NULL;
+
+    p = blob;
+    memcpy(p, RESUME_MAGIC, 4);
+    p[4] = RESUME_VERSION & 0xFF;
+    p[5] = (RESUME_VERSION >> 8) & 0xFF;
+    p[6] = SEEK_POINT_SIZE & 0xFF;
+    p[7] = (SEEK_POINT_SIZE >> 8) & 0xFF;
+    p = seekPack32(p + 8, hash);
+
+    seekPack(p, cvt, st, record);
+    p += SEEK_POINT_SIZE;
+
+    p = seekPack32(p, (uint32_t)cvt->midi_eventCode);
+    p = seekPack32(p, cvt->midi_delta);
+    p = seekPack32(p, cvt->midi_fileSize);
+    p = seekPack32(p, cvt->midi_trackBegin);
+    p = seekPack32(p, cvt->midi_tracksNum);
+    p = seekPack32(p, cvt->midi_time);
+    p = seekPack32(p, (uint32_t)cvt->midi_isEndOfTrack);
+    p = seekPack16(p, instIdPrev, IMF2MID_CHANNELS);
+    seekPackInstState(p, 0);
+
+    return blob;
+}
+
+static void resumeSave(const char *path_out, uint32_t hash,
+                       struct Imf2MIDI_CVT *cvt, struct SongState *st,
+                       uint32_t record, const uint16_t *instIdPrev)
+{
+    uint32_t size = 0;
+    size_t   written;
+    uint8_t *blob;
+    char    *path, *tmpPath;
+    FILE    *f;
+
+    blob = resumePack(hash, cvt, st, record, instIdPrev, &size);
+    path = resumePath(path_out);
+    tmpPath = path ? (char *)malloc(strlen(path) + 5) : NULL;
+    if(!blob || !path || !tmpPath)
+        goto done;
+
+    /* Write into the temporary file to never leave the broken snapshot */
+    sprintf(tmpPath, "%s.tmp", path);
+    f = fopen(tmpPath, "wb");
+    if(!f)
+    {
+        logMessage(IMF2MID_LOG_WARN, "Can't open file %s for write!\n\n", tmpPath);
+        goto done;
+    }
+
+    written = fwrite(blob, 1, size, f);
+    if((fclose(f) != 0) || (written != size))
+    {
+        logMessage(IMF2MID_LOG_WARN, "Failed to write %s!\n\n", tmpPath);
+        remove(tmpPath);
+        goto done;
+    }
+
+    remove(path);
+    if(rename(tmpPath, path) != 0)
+        logMessage(IMF2MID_LOG_WARN, "Can't rename %s into %s!\n\n", tmpPath, path);
+
+done:
+    if(blob)
+        free(blob);
+    if(path)
+        free(path);
+    if(tmpPath)
+        free(tmpPath);
+}
+
+/* Checks the lists of instruments stored after the fixed part of the snapshot */
+static int resumeIsComplete(const uint8_t *blob, size_t size)
+{
+    size_t at = RESUME_FIXED_SIZE - 4;
+    return seekCheckInstState(blob + at, size - at) == size - at;
+}
+
+/**
+ * @brief Reads the snapshot of the interrupted conversion
+ * @param path_out path to the MIDI file
+ * @param hash hash of the song
+ * @param size size of the snapshot
+ * @return snapshot which must be freed, or NULL if there is no valid snapshot
+ */
+static uint8_t *resumeRead(const char *path_out, uint32_t hash, size_t *size)
+{
+    uint8_t *blob = NULL;
+    char    *path = resumePath(path_out);
+    long     fileSize;
+    FILE    *f;
+
+    if(!path)
+        return NULL;
+    f = fopen(path, "rb");
+    free(path);
+    if(!f)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    fileSize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if(fileSize >= (long)(RESUME_FIXED_SIZE + 6))
+        blob = (uint8_t *)malloc((size_t)fileSize);
+
+    if(!blob || (fread(blob, 1, (size_t)fileSize, f) != (size_t)fileSize) ||
+       (memcmp(blob, RESUME_MAGIC, 4) != 0) ||
+       ((blob[4] | (blob[5] << 8)) != RESUME_VERSION) ||
+       ((blob[6] | (blob[7] << 8)) != SEEK_POINT_SIZE) ||
+       (readLE32buf(blob + 8) != hash) ||
+       !resumeIsComplete(blob, (size_t)fileSize))
+    {
+        logMessage(IMF2MID_LOG_INFO, "-- Snapshot of conversion is outdated, converting from the begin --\n");
+        if(blob)
+            free(blob);
+        fclose(f);
+        return NULL;
+    }
+
+    fclose(f);
+    *size = (size_t)fileSize;
+    return blob;
+}
+
+/* Size of MIDI data written before the snapshot was taken */
+static uint32_t resumeOutputSize(const uint8_t *blob)
+{
+    return readLE32buf(blob + RESUME_HEAD_SIZE + SEEK_POINT_SIZE + 8);
+}
+
+/**
+ * @brief Restores the state of the interrupted conversion
+ * @param blob snapshot checked by resumeRead()
+ * @param cvt converter context
+ * @param st song state
+ * @param instIdPrev IDs of previous instruments of IMF channels
+ * @param record index of the next IMF record
+ */
+static void resumeApply(const uint8_t *blob,
+                        struct Imf2MIDI_CVT *cvt, struct SongState *st,
+                        uint16_t *instIdPrev, uint32_t *record)
+{
+    const uint8_t *p = blob + RESUME_HEAD_SIZE;
+
+    *record = seekUnpack(p, cvt, st);
+    p += SEEK_POINT_SIZE;
+
+    cvt->midi_eventCode    = (int)(int32_t)readLE32buf(p);
+    cvt->midi_delta        = readLE32buf(p + 4);
+    cvt->midi_fileSize     = readLE32buf(p + 8);
+    cvt->midi_trackBegin   = readLE32buf(p + 12);
+    cvt->midi_tracksNum    = readLE32buf(p + 16);
+    cvt->midi_time         = readLE32buf(p + 20);
+    cvt->midi_isEndOfTrack = (int)readLE32buf(p + 24);
+    p += 28;
+    p = seekUnpack16(p, instIdPrev, IMF2MID_CHANNELS);
+    seekUnpackInstState(p, 0);
+}
+/*****************************************************************/
+
+
+/*****************************************************************
+ *                    Incremental conversion                     *
+ *****************************************************************/
+
+/*
+ * Incremental conversion keeps snapshots of the conversion taken at
+ * regular intervals next to the MIDI file (its name with ".inc" suffix).
+ * Every snapshot is keyed by the hash of IMF records before it, so after
+ * the song was edited, the conversion continues from the latest snapshot
+ * before the first changed record, and the MIDI data written before it
+ * is copied from the old file. Format of the file (all integers are
+ * little-endian):
+ *   char[4]     magic "I2MI"
+ *   uint16      format version
+ *   uint16      size of the song state
+ *   uint32      hash of the options and the instrument table
+ *   uint32      hash of the song (same as the update mode uses)
+ *   uint32      size of the MIDI file
+ *   uint32      count of snapshots, and for each of them:
+ *     uint32    hash of IMF records before the snapshot
+ *     uint32    size of the snapshot
+ *     ...       snapshot, same as of the resumable conversion
+ */
+#define INCR_MAGIC          "I2MI"
+#define INCR_VERSION        2
+#define INCR_HEAD_SIZE      24
+#define INCR_INTERVAL       SEEK_INTERVAL
+
+struct IncrPoint
+{
+    uint32_t record;
+    uint32_t hash;
+    uint32_t size;
+    uint8_t *blob;
+};
+
+static struct IncrPoint *INCR_points = NULL;
+static uint32_t          INCR_count = 0;
+static uint32_t          INCR_capacity = 0;
+static uint32_t          INCR_next = 0;
+
+static char *incrPath(const char *path_out)
+{
+    char *path = (char *)malloc(strlen(path_out) + 5);
+    if(path)
+        sprintf(path, "%s.inc", path_out);
+    return path;
+}
+
+static void incrReset(void)
+{
+    uint32_t i;
+
+    for(i = 0; i < INCR_count; i++)
+        free(INCR_points[i].blob);
+    if(INCR_points)
+        free(INCR_points);
+    INCR_points = NULL;
+    INCR_count = INCR_capacity = 0;
+    INCR_next = 0;
+}
+
+static int incrAppend(uint32_t record, uint32_t hash, uint8_t *blob, uint32_t size)
+{
+    if(INCR_count >= INCR_capacity)
+    {
+        uint32_t capacity = INCR_capacity ? (INCR_capacity * 2) : 64;
+        struct IncrPoint *points = (struct IncrPoint *)realloc(INCR_points, (size_t)capacity * sizeof(struct IncrPoint));
+        if(!points)
+            return 0;
+        INCR_points = points;
+        INCR_capacity = capacity;
+    }
+
+    INCR_points[INCR_count].record = record;
+    INCR_points[INCR_count].hash = hash;
+    INCR_points[INCR_count].size = size;
+    INCR_points[INCR_count].blob = blob;
+    INCR_count++;
+    return 1;
+}
+
+/* Takes the snapshot when the time has come, records are hashed on write */
+static void incrAddPoint(uint32_t settingsHash, const struct Imf2MIDI_CVT *cvt,
+                         const struct SongState *st, uint32_t record, const uint16_t *instIdPrev)
+{
+    uint32_t size = 0;
+    uint8_t *blob;
+
+    if(st->tick < INCR_next)
+        return;
+
+    blob = resumePack(settingsHash, cvt, st, record, instIdPrev, &size);
+    if(blob && !incrAppend(record, 0, blob, size))
+        free(blob);
+
+    while(INCR_next <= st->tick)
+        INCR_next += INCR_INTERVAL;
+}
+
+/**
+ * @brief Continues hashing of IMF records up to given one
+ * @param f song file, positioned at the record "at"
+ * @param h hash of the records before "at"
+ * @param at index of the next record to hash, will be set to "record"
+ * @param record index of the record to stop before
+ * @return 1 on success, 0 if the song ends before that record
+ */
+static int incrHashRecords(FILE *f, uint32_t *h, uint32_t *at, uint32_t record)
+{
+    uint8_t chunk[512];
+
+    while(*at < record)
+    {
+        size_t want = sizeof(chunk) / 4;
+        if(want > record - *at)
+            want = (size_t)(record - *at);
+        if(fread(chunk, 4, want, f) != want)
+            return 0;
+        *h = fuzzyHashData(*h, chunk, want * 4);
+        *at += (uint32_t)want;
+    }
+
+    return 1;
+}
+
+/* Copies the beginning of the old MIDI file which stays the same */
+static int incrCopyPrefix(FILE *from, FILE *to, uint32_t size)
+{
+    uint8_t chunk[4096];
+
+    while(size > 0)
+    {
+        size_t want = (size < sizeof(chunk)) ? (size_t)size : sizeof(chunk);
+        if((fread(chunk, 1, want, from) != want) || (fwrite(chunk, 1, want, to) != want))
+            return 0;
+        size -= (uint32_t)want;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Finds the latest snapshot taken before the first changed record of the song
+ * @param cvt converter context
+ * @param settingsHash hash of the options and the instrument table
+ * @param hash hash of the song
+ * @param upToDate set to 1 when the song and the MIDI file weren't changed at all
+ * @return snapshot to continue from, or NULL to convert the whole song
+ *
+ * Snapshots before the found one stay loaded and get written again.
+ */
+static const uint8_t *incrFind(struct Imf2MIDI_CVT *cvt, uint32_t settingsHash, uint32_t hash, int *upToDate)
+{
+    uint8_t  head[INCR_HEAD_SIZE];
+    uint32_t count, i, h, at = 0, imf_length;
+    char    *path = incrPath(cvt->path_out);
+    FILE    *f, *song = NULL, *out;
+    long     outSize = -1;
+
+    *upToDate = 0;
+    incrReset();
+
+    if(!path)
+        return NULL;
+    f = fopen(path, "rb");
+    free(path);
+    if(!f)
+        return NULL;
+
+    out = fopen(cvt->path_out, "rb");
+    if(out)
+    {
+        fseek(out, 0, SEEK_END);
+        outSize = ftell(out);
+        fclose(out);
+    }
+
+    /* The MIDI file must be the same as written by the previous conversion */
+    if((fread(head, 1, INCR_HEAD_SIZE, f) != INCR_HEAD_SIZE) ||
+       (memcmp(head, INCR_MAGIC, 4) != 0) ||
+       ((head[4] | (head[5] << 8)) != INCR_VERSION) ||
+       ((head[6] | (head[7] << 8)) != SEEK_POINT_SIZE) ||
+       (readLE32buf(head + 8) != settingsHash) ||
+       (outSize < 0) || ((uint32_t)outSize != readLE32buf(head + 16)))
+    {
+        logMessage(IMF2MID_LOG_INFO, "-- Snapshots of previous conversion are outdated, converting from the begin --\n");
+        fclose(f);
+        return NULL;
+    }
+
+    if(readLE32buf(head + 12) == hash)
+    {
+        *upToDate = 1;
+        fclose(f);
+        return NULL;
+    }
+
+    song = fopen(cvt->path_in, "rb");
+    if(!song)
+    {
+        fclose(f);
+        return NULL;
+    }
+
+    imf_length = readLE32(song);
+    imf_length = (imf_length >= 4) ? (imf_length - 4) : 0;
+    h = settingsHash;
+    count = readLE32buf(head + 20);
+
+    for(i = 0; i < count; i++)
+    {
+        uint8_t  point[8];
+        uint8_t *blob;
+        uint32_t size, record;
+
+        if(fread(point, 1, 8, f) != 8)
+            break;
+
+        size = readLE32buf(point + 4);
+        if((size < RESUME_FIXED_SIZE + 6) || (size > 0x100000UL))
+            break;
+
+        blob = (uint8_t *)malloc(size);
+        if(!blob)
+            break;
+
+        if((fread(blob, 1, size, f) != size) ||
+           (readLE32buf(blob + 8) != settingsHash) ||
+           !resumeIsComplete(blob, size))
+        {
+            free(blob);
+            break;
+        }
+
+        /* Records after the snapshot must remain, at least the one it was taken before */
+        record = readLE32buf(blob + RESUME_HEAD_SIZE);
+        if((record >= imf_length / 4) ||
+           !incrHashRecords(song, &h, &at, record) ||
+           (h != readLE32buf(point)) ||
+           !incrAppend(record, h, blob, size))
+        {
+            free(blob);
+            break;
+        }
+    }
+
+    fclose(song);
+    fclose(f);
+
+    if(INCR_count == 0)
+        return NULL;
+
+    /* Next snapshots are taken at the same times as before */
+    INCR_next = 0;
+    while(INCR_next <= readLE32buf(INCR_points[INCR_count - 1].blob + RESUME_HEAD_SIZE + 4))
+        INCR_next += INCR_INTERVAL;
+
+    return INCR_points[INCR_count - 1].blob;
+}
+
+/**
+ * @brief Writes snapshots of the complete conversion
+ * @param cvt converter context
+ * @param settingsHash hash of the options and the instrument table
+ * @param hash hash of the song
+ */
+static void incrWrite(struct Imf2MIDI_CVT *cvt, uint32_t settingsHash, uint32_t hash)
 {
-    int16_t nextfreqIndex = nearestFreq((uint16_t)freq);
-    int16_t nextfreq = (int16_t)note_frequencies[nextfreqIndex];
-
-    if(nextfreq == freq)
+    uint8_t  head[INCR_HEAD_SIZE];
+    uint8_t  point[8];
+    uint32_t i, j, h = settingsHash, at = 0;
+    char    *path = incrPath(cvt->path_out);
+    char    *tmpPath = path ? (char *)malloc(strlen(path) + 5) : NULL;
+    FILE    *song, *f = NULL;
+    int      ok = 0;
+
+    song = fopen(cvt->path_in, "rb");
+    if(!song || !tmpPath)
+        goto done;
+
+    /* Records are hashed after the length of the song, which changes on every edit */
+    readLE32(song);
+    for(i = 0; i < INCR_count; i++)
     {
-        /* Default state */
-        /*MIDI_writePitchEvent(f, cvt, cvt->midi_mapchannel[channel], MIDI_PITCH_CENTER);*/
-        pitchs[channel] = MIDI_PITCH_CENTER;
-        return;
+        if(!incrHashRecords(song, &h, &at, INCR_points[i].record))
+            break;
+        INCR_points[i].hash = h;
     }
 
-    if(freq == 0)
-        return;
+    sprintf(tmpPath, "%s.tmp", path);
+    f = fopen(tmpPath, "wb");
+    if(!f)
+    {
+        logMessage(IMF2MID_LOG_WARN, "Can't open file %s for write!\n\n", tmpPath);
+        goto done;
+    }
 
-    if(nextfreq > freq)
+    memcpy(head, INCR_MAGIC, 4);
+    head[4] = INCR_VERSION & 0xFF;
+    head[5] = (INCR_VERSION >> 8) & 0xFF;
+    head[6] = SEEK_POINT_SIZE & 0xFF;
+    head[7] = (SEEK_POINT_SIZE >> 8) & 0xFF;
+    seekPack32(head + 8, settingsHash);
+    seekPack32(head + 12, hash);
+    seekPack32(head + 16, cvt->midi_fileSize);
+    seekPack32(head + 20, i);
+
+    ok = (fwrite(head, 1, INCR_HEAD_SIZE, f) == INCR_HEAD_SIZE);
+    for(j = 0; ok && (j < i); j++)
     {
-        /* Pitch Up */
-        /* Two half-tones up */
-        int16_t freqR = relativeFreq(nextfreqIndex, 2);
-        if(freqR >= 0)
-        {
-            /* pitch relative */
-            pitchs[channel] = (uint16_t)(MIDI_PITCH_CENTER
-                            + (0x2000 * (((double)freq - (double)nextfreq) / ((double)freqR - (double)nextfreq))) );
-        }
+        seekPack32(point, INCR_points[j].hash);
+        seekPack32(point + 4, INCR_points[j].size);
+        ok = (fwrite(point, 1, 8, f) == 8) &&
+             (fwrite(INCR_points[j].blob, 1, INCR_points[j].size, f) == INCR_points[j].size);
     }
-    else
+
+    if((fclose(f) != 0) || !ok)
     {
-        /* Pitch down */
-        /* Two half-tones down */
-        int16_t freqR = relativeFreq(nextfreqIndex, -2);
-        if(freqR >= 0)
-        {
-            /* pitch relative */
-            pitchs[channel] = (uint16_t)(MIDI_PITCH_CENTER
-                                         - (0x2000 * (((double)nextfreq - (double)freq) / ((double)nextfreq - (double)freqR))) );
-        }
+        logMessage(IMF2MID_LOG_WARN, "Failed to write %s!\n\n", tmpPath);
+        remove(tmpPath);
+        goto done;
     }
+
+    remove(path);
+    if(rename(tmpPath, path) != 0)
+        logMessage(IMF2MID_LOG_WARN, "Can't rename %s into %s!\n\n", tmpPath, path);
+
+done:
+    if(song)
+        fclose(song);
+    if(path)
+        free(path);
+    if(tmpPath)
+        free(tmpPath);
 }
 /*****************************************************************/
 
 
-
-void Imf2MIDI_init(struct Imf2MIDI_CVT *cvt)
+/* Resets the state of the song, but keeps settings */
+static void Imf2MIDI_resetSong(struct Imf2MIDI_CVT *cvt)
 {
     size_t i = 0;
 
-    if(!cvt)
-        return;
-
     memset(cvt->imf_instruments,     0, sizeof(cvt->imf_instruments));
     memset(cvt->imf_instrumentsPrev, 0, sizeof(cvt->imf_instrumentsPrev));
     memset(cvt->midi_mapchannel,     0, sizeof(cvt->midi_mapchannel));
     memset(cvt->midi_lastpatch,      0, sizeof(cvt->midi_lastpatch));
     memset(cvt->midi_lastpitch,      0, sizeof(cvt->midi_lastpitch));
+    memset(cvt->midi_voicePatch,     MIDI_PATCH_NONE, sizeof(cvt->midi_voicePatch));
+    memset(cvt->midi_channelUsed,    0, sizeof(cvt->midi_channelUsed));
+    memset(cvt->midi_keysOn,         0, sizeof(cvt->midi_keysOn));
+    MIDI_queueCount = 0;
 
-    cvt->midi_resolution    = 384;
-    cvt->midi_tempo         = 110.0;
-
-    for(i = 0; i < 9; i++)
+    for(i = 0; i < IMF2MID_MIDI_CHANNELS; i++)
+    {
+        cvt->midi_lastpatch[i] = MIDI_PATCH_NONE;
         cvt->midi_lastpitch[i] = MIDI_PITCH_CENTER;
+    }
 
     cvt->midi_trackBegin    = 0;
     cvt->midi_pos           = 0;
@@ -1039,12 +4937,67 @@ void Imf2MIDI_init(struct Imf2MIDI_CVT *cvt)
     cvt->midi_isEndOfTrack  = 1;
     cvt->midi_delta         = 0;
     cvt->midi_time          = 0;
+}
+
+void Imf2MIDI_init(struct Imf2MIDI_CVT *cvt)
+{
+    if(!cvt)
+        return;
+
+    Imf2MIDI_resetSong(cvt);
+
+    cvt->midi_resolution    = 384;
+    cvt->midi_tempo         = 110.0;
 
     cvt->path_in    = NULL;
     cvt->path_out   = NULL;
+    cvt->in_offset  = 0;
+    cvt->in_size    = 0;
 
     cvt->flag_usePitch = 1;
     cvt->flag_logInstruments = 0;
+    cvt->flag_fuzzyMatch = 0;
+    cvt->flag_logPrefix = 0;
+    cvt->flag_update = 0;
+    cvt->flag_seekIndex = 0;
+    cvt->flag_resume = 0;
+    cvt->flag_incremental = 0;
+    cvt->flag_allocChannels = 0;
+    cvt->flag_optimize = 0;
+    cvt->range_from = 0;
+    cvt->range_to = 0;
+}
+
+void Imf2MIDI_reloadTables(void)
+{
+    if(INST_dbLoaded)
+    {
+        instDbClose(&INST_db);
+        INST_dbLoaded = 0;
+    }
+
+    /* Will be checked again against the new table */
+    fuzzyCacheClose();
+    STATE_tableVersionReady = 0;
+}
+
+void Imf2MIDI_shutdown(void)
+{
+    if(INST_dbLoaded)
+    {
+        instDbClose(&INST_db);
+        INST_dbLoaded = 0;
+    }
+
+    if(INST_learned)
+        INST_learned = (jwHashTable *)delete_hash(INST_learned);
+
+    fuzzyCacheClose();
+    discoveryReset();
+    instLogClose();
+    stateClose();
+    Imf2MIDI_closeArchive();
+    Imf2MIDI_closeCatalog();
 }
 
 int Imf2MIDI_process(struct Imf2MIDI_CVT* cvt, int log)
@@ -1054,54 +5007,47 @@ int Imf2MIDI_process(struct Imf2MIDI_CVT* cvt, int log)
 
     FILE    *file_in  = NULL;
     FILE    *file_out = NULL;
-    const char* inst_log_name = "instlog.txt";
-    FILE    *inst_log = NULL;
 
     uint8_t  c;
-    uint8_t  imf_buff[4];
-    int      imf_insChange[9];
+    uint8_t *imf_rec = NULL;
+    size_t   imf_blockSize = 0;
+    size_t   imf_blockPos = 0;
+    int      imf_eof = 0;
+    uint16_t imf_instIdPrev[IMF2MID_CHANNELS];
     uint32_t imf_length = 0;
     uint16_t imf_delay  = 0;
-    uint16_t imf_freq[9];
-    uint8_t  imf_octs[9];
-    uint8_t  imf_key_st[9];
-    uint8_t  imf_key_st_prev[9];
-
-    /* Array of pressed keys which allows to mute a pitched or toggled notes without powering off */
-    uint8_t  imf_keys[9];
-    uint8_t  imf_keys_prev[9];
-
-    uint16_t imf_pitchs[9] =
-    {
-        MIDI_PITCH_CENTER, MIDI_PITCH_CENTER, MIDI_PITCH_CENTER,
-        MIDI_PITCH_CENTER, MIDI_PITCH_CENTER, MIDI_PITCH_CENTER,
-        MIDI_PITCH_CENTER, MIDI_PITCH_CENTER, MIDI_PITCH_CENTER,
-    };
-    uint16_t imf_pitchs_prev[9] =
-    {
-        MIDI_PITCH_CENTER, MIDI_PITCH_CENTER, MIDI_PITCH_CENTER,
-        MIDI_PITCH_CENTER, MIDI_PITCH_CENTER, MIDI_PITCH_CENTER,
-        MIDI_PITCH_CENTER, MIDI_PITCH_CENTER, MIDI_PITCH_CENTER,
-    };
-    uint8_t  imf_channel = 0;
+    uint32_t imf_recordsRead = 0;
+    uint32_t imf_blockFirst = 0;
+    uint32_t inputHash = 0;
+    int      inputHashReady = 0;
+    int      journal = 0;
+    int      ranged = 0;
+    int      seekBuild = 0;
+    uint32_t seekRecord = 0;
+    uint32_t imf_dirty;
+    int      resumable = 0;
+    uint8_t *resumeData = NULL;
+    size_t   resumeSize = 0;
+    char    *resumeFile;
+    uint32_t resumeRecord = 0;
+    uint32_t resumeNext = RESUME_INTERVAL;
+    int      incremental = 0;
+    int      incrSave = 0;
+    uint32_t incrSettings = 0;
+    const uint8_t *incrData = NULL;
+    char    *incrTemp = NULL;
+    struct SongState st;
     uint8_t  imf_regKey = 0;
     uint8_t  imf_regVal = 0;
 
-    jwHashTable *inst_table = NULL;
-
-    memset(imf_buff, 0, sizeof(imf_buff));
-    memset(imf_insChange, 0, sizeof(imf_insChange));
-    memset(imf_freq, 0, sizeof(imf_freq));
-    memset(imf_octs, 0, sizeof(imf_octs));
-
-    memset(imf_key_st, 0, sizeof(imf_key_st));
-    memset(imf_key_st_prev, 0, sizeof(imf_key_st_prev));
-    memset(imf_keys, 0, sizeof(imf_keys));
-    memset(imf_keys_prev, 0, sizeof(imf_keys_prev));
+    songStateReset(&st);
 
     if(!cvt)
         return res;
 
+    logSetLevel(log);
+    LOG_prefix = cvt->flag_logPrefix ? cvt->path_in : NULL;
+
     /* Calculate target path */
     if(!cvt->path_out)
     {
@@ -1123,192 +5069,448 @@ int Imf2MIDI_process(struct Imf2MIDI_CVT* cvt, int log)
 
     if(strcmp(cvt->path_in, cvt->path_out) == 0)
     {
-        fprintf(stderr, "\x1b[31mERROR:\x1b[0m File names are must not be same!\n\n");
+        logMessage(IMF2MID_LOG_ERROR, "File names are must not be same!\n\n");
         goto quit;
     }
 
-    inst_table = loadInstMap();
+    Imf2MIDI_resetSong(cvt);
 
-    if(log)
-    {
-        printf("=============================\n"
-               "Convert into \"%s\"\n"
-               "=============================\n\n", cvt->path_out);
+    instDbShared();
 
-        if(!cvt->flag_usePitch)
-            printf("-- Pitch detection is disabled --\n");
+    ranged = (cvt->range_from > 0) || (cvt->range_to > 0);
 
-        if(inst_table)
-            printf("-- Found an instrument detection table! --\n");
+    /* Archive is written from scratch, so nothing can be skipped */
+    if(cvt->flag_update && !ARCH_file && (cvt->in_size == 0) && !ranged)
+    {
+        if(!STATE_loaded)
+            stateLoad();
+
+        inputHashReady = STATE_table && stateFileHash(cvt, &inputHash);
+        if(inputHashReady && stateIsUpToDate(cvt, inputHash))
+        {
+            logMessage(IMF2MID_LOG_INFO, "-- \"%s\" is up to date --\n", cvt->path_out);
+            res = 0;
+            goto quit;
+        }
     }
 
+    /* Snapshots are taken for a separate song file only */
+    resumable = cvt->flag_resume && !ARCH_file && (cvt->in_size == 0) && !ranged;
+    if(resumable && !inputHashReady)
+        inputHashReady = stateFileHash(cvt, &inputHash);
+    resumable = resumable && inputHashReady;
+
+    /* Snapshots of the edited song are matched against the song file only */
+    incremental = cvt->flag_incremental && !ARCH_file && (cvt->in_size == 0) && !ranged;
+    if(incremental && !inputHashReady)
+        inputHashReady = stateFileHash(cvt, &inputHash);
+    incremental = incremental && inputHashReady;
+    if(incremental)
+        incrSettings = stateSettingsHash(cvt);
+
+    /* One call per line: every line gets the prefix of the file */
+    logMessage(IMF2MID_LOG_INFO, "=============================\n");
+    logMessage(IMF2MID_LOG_INFO, "Convert into \"%s\"\n", cvt->path_out);
+    logMessage(IMF2MID_LOG_INFO, "=============================\n\n");
+
+    if(!cvt->flag_usePitch)
+        logMessage(IMF2MID_LOG_INFO, "-- Pitch detection is disabled --\n");
+
+    if(INST_db.text)
+        logMessage(IMF2MID_LOG_INFO, "-- Found an instrument detection table! --\n");
+    else if(instDbIsBinary(&INST_db))
+        logMessage(IMF2MID_LOG_INFO, "-- Found an instrument database (%lu instruments)! --\n", (unsigned long)INST_db.binCount);
+    else if(REGTABLE_COUNT > 0)
+        logMessage(IMF2MID_LOG_INFO, "-- Using built-in instrument detection table --\n");
+
+    /* Don't create the output file when there is nothing to convert */
     file_in  = fopen(cvt->path_in, "rb");
-    file_out = fopen(cvt->path_out, "wb");
-    if(cvt->flag_logInstruments)
-        inst_log = fopen(inst_log_name, "a");
-
     if(!file_in)
     {
-        fprintf(stderr, "\x1b[31mERROR:\x1b[0m Can't open file %s for read!\n\n", cvt->path_in);
+        logMessage(IMF2MID_LOG_ERROR, "Can't open file %s for read!\n\n", cvt->path_in);
         goto quit;
     }
 
-    if(!file_out)
+    /* Both files are accessed by large blocks, stdio buffers would only copy them */
+    setvbuf(file_in, NULL, _IONBF, 0);
+
+    if(cvt->in_offset > 0)
+        fseek(file_in, cvt->in_offset, SEEK_SET);
+
+    if(!ARCH_file)
     {
-        fprintf(stderr, "\x1b[31mERROR:\x1b[0m Can't open file %s for write!\n\n", cvt->path_out);
-        goto quit;
+        if(resumable)
+            resumeData = resumeRead(cvt->path_out, inputHash, &resumeSize);
+
+        /* Continue the file of interrupted conversion when it's still there */
+        if(resumeData)
+        {
+            file_out = fopen(cvt->path_out, "r+b");
+            if(file_out)
+            {
+                fseek(file_out, 0, SEEK_END);
+                if(ftell(file_out) < (long)resumeOutputSize(resumeData))
+                {
+                    fclose(file_out);
+                    file_out = NULL;
+                }
+            }
+
+            if(!file_out)
+            {
+                free(resumeData);
+                resumeData = NULL;
+            }
+        }
+
+        if(!resumeData && incremental)
+        {
+            int upToDate = 0;
+            incrData = incrFind(cvt, incrSettings, inputHash, &upToDate);
+
+            if(upToDate)
+            {
+                logMessage(IMF2MID_LOG_INFO, "-- \"%s\" is up to date --\n", cvt->path_out);
+                res = 0;
+                goto quit;
+            }
+        }
+
+        /* Unchanged beginning goes into the new file, the old one stays until the end */
+        if(incrData)
+        {
+            FILE *file_old = fopen(cvt->path_out, "rb");
+
+            incrTemp = (char *)malloc(strlen(cvt->path_out) + 5);
+            if(incrTemp)
+            {
+                sprintf(incrTemp, "%s.tmp", cvt->path_out);
+                file_out = fopen(incrTemp, "wb");
+            }
+
+            if(!file_old || !file_out || !incrCopyPrefix(file_old, file_out, resumeOutputSize(incrData)))
+            {
+                if(file_out)
+                {
+                    fclose(file_out);
+                    file_out = NULL;
+                    remove(incrTemp);
+                }
+                if(incrTemp)
+                {
+                    free(incrTemp);
+                    incrTemp = NULL;
+                }
+                incrReset();
+                incrData = NULL;
+            }
+
+            if(file_old)
+                fclose(file_old);
+        }
+
+        if(!file_out)
+            file_out = fopen(cvt->path_out, "wb");
+        if(!file_out)
+        {
+            logMessage(IMF2MID_LOG_ERROR, "Can't open file %s for write!\n\n", cvt->path_out);
+            goto quit;
+        }
+        setvbuf(file_out, NULL, _IONBF, 0);
     }
 
     imf_length = readLE32(file_in);
     if(imf_length == 0)
     {
-        fprintf(stderr, "\x1b[31mERROR:\x1b[0m Failed to read IMF length!\n\n");
+        logMessage(IMF2MID_LOG_ERROR, "Failed to read IMF length!\n\n");
         goto quit;
     }
 
     imf_length -= 4;
 
-    MIDI_writeHead(file_out, cvt);
-    MIDI_beginTrack(file_out, cvt);
-    MIDI_writeTempoEvent(file_out, cvt, (uint32_t)(60000000.0 / cvt->midi_tempo));
-    MIDI_writeMetricKeyEvent(file_out, cvt, 4, 4, 24, 8);
+    /* Song stored in a game archive must not run into the next chunk */
+    if(cvt->in_size > 0)
+    {
+        if(imf_length > (uint32_t)cvt->in_size - 4)
+        {
+            logMessage(IMF2MID_LOG_WARN, "IMF length is longer than file itself!\n\n");
+            imf_length = (uint32_t)cvt->in_size - 4;
+        }
+        imf_length &= ~3UL;
+    }
+
+    if(ARCH_file)
+    {
+        if(!archiveBegin(cvt->path_out))
+            goto quit;
+        file_out = ARCH_file;
+    }
+    else
+        fbeginb(file_out, 0);
+
+    /* Checkpoints count random patches of this song only */
+    SEEK_randBase = INST_randCount;
 
-    for(c = 0; c < 9; c++)
+    if(resumeData)
+    {
+        resumeApply(resumeData, cvt, &st, imf_instIdPrev, &resumeRecord);
+        logMessage(IMF2MID_LOG_INFO, "-- Continue interrupted conversion from the record %lu --\n", (unsigned long)resumeRecord);
+        fseek(file_in, 4 + (long)(resumeRecord * 4), SEEK_SET);
+        imf_length -= resumeRecord * 4;
+        imf_recordsRead = resumeRecord;
+        resumeNext = st.tick + RESUME_INTERVAL;
+        fseekb(file_out, (long)cvt->midi_fileSize);
+    }
+    else if(incrData)
     {
-        imf_freq[c] = 0;
-        imf_octs[c] = 0;
-        cvt->midi_mapchannel[c] = c;
+        resumeApply(incrData, cvt, &st, imf_instIdPrev, &resumeRecord);
+        logMessage(IMF2MID_LOG_INFO, "-- Song is unchanged before the record %lu, converting the rest --\n", (unsigned long)resumeRecord);
+        fseek(file_in, 4 + (long)(resumeRecord * 4), SEEK_SET);
+        imf_length -= resumeRecord * 4;
+        imf_recordsRead = resumeRecord;
+        fseekb(file_out, (long)cvt->midi_fileSize);
+    }
+    else
+    {
+        MIDI_writeHead(file_out, cvt);
+        MIDI_beginTrack(file_out, cvt);
+        MIDI_writeTempoEvent(file_out, cvt, (uint32_t)(60000000.0 / cvt->midi_tempo));
+        MIDI_writeMetricKeyEvent(file_out, cvt, 4, 4, 24, 8);
+
+        /* Previous instruments are zeroed, so they are all the same first entry */
+        instCacheReset();
+        for(c = 0; c < IMF2MID_CHANNELS; c++)
+        {
+            st.imf_freq[c] = 0;
+            st.imf_octs[c] = 0;
+            cvt->midi_mapchannel[c] = c;
+            imf_instIdPrev[c] = instIntern(&cvt->imf_instrumentsPrev[c]);
+        }
+
+        /* Allocated notes may get into any MIDI channel except of drums */
+        for(c = 0; c < IMF2MID_MIDI_CHANNELS; c++)
+        {
+            if((c < IMF2MID_CHANNELS) || (cvt->flag_allocChannels && (c != MIDI_DRUM_CHANNEL)))
+                MIDI_writeControlEvent(file_out, cvt, c, MIDI_CONTROLLER_VOLUME, 127);
+        }
+        MIDI_flushEvents(file_out, cvt);
     }
 
-    for(c = 0; c <= 8; c++)
+    /* Seek index belongs to the song file, not to a part of another file */
+    if((cvt->flag_seekIndex || (cvt->range_from > 0)) && (cvt->in_size == 0) && !inputHashReady)
+        inputHashReady = stateFileHash(cvt, &inputHash);
+
+    if((cvt->range_from > 0) && inputHashReady &&
+       seekFind(cvt, inputHash, cvt->range_from, &st, &seekRecord) &&
+       ((seekRecord * 4) <= imf_length))
     {
-        MIDI_writeControlEvent(file_out, cvt, c, MIDI_CONTROLLER_VOLUME, 127);
-        cvt->midi_lastpatch[c] = c;
+        logMessage(IMF2MID_LOG_INFO, "-- Continue from the record %lu of the seek index --\n", (unsigned long)seekRecord);
+        for(c = 0; c < IMF2MID_CHANNELS; c++)
+            imf_instIdPrev[c] = instIntern(&cvt->imf_instrumentsPrev[c]);
+        fseek(file_in, cvt->in_offset + 4 + (long)(seekRecord * 4), SEEK_SET);
+        imf_length -= seekRecord * 4;
+        imf_recordsRead = seekRecord;
     }
 
-    while(imf_length > 0)
+    /* Only the walk through the whole song makes the complete index */
+    seekBuild = cvt->flag_seekIndex && inputHashReady && !ranged;
+    seekReset();
+
+    /* Everything before the range is converted without writing */
+    BUF_mute = (cvt->range_from > 0);
+
+    for(;;)
     {
-        imf_length -= 4;
-        if(fread(imf_buff, 1, 4, file_in) != 4)
+        if(imf_blockPos >= imf_blockSize)
         {
-            fprintf(stderr, "\x1b[31mWARNING:\x1b[0m IMF length is longer than file itself!\n\n");
-            break; /* File end*/
+            if(imf_length == 0)
+                break;
+
+            if(imf_eof)
+            {
+                logMessage(IMF2MID_LOG_WARN, "IMF length is longer than file itself!\n\n");
+                break; /* File end*/
+            }
+
+            imf_blockSize = IMF_readBlock(file_in, IMF_block, &imf_length, &imf_eof);
+            imf_blockFirst = imf_recordsRead;
+            imf_recordsRead += (uint32_t)imf_blockSize;
+            imf_blockSize = IMF_prescanBlock(IMF_block, imf_blockSize);
+            imf_blockPos  = 0;
+            continue;
         }
 
-        imf_delay   = (imf_buff[0] & 0x00FF) | ((imf_buff[1]<<8) & 0xFF00);
-        imf_regKey  =  imf_buff[2];
-        imf_regVal  =  imf_buff[3];
+        imf_rec = IMF_block + (imf_blockPos * 4);
+        imf_blockPos++;
+
+        imf_delay   = (imf_rec[0] & 0x00FF) | ((imf_rec[1]<<8) & 0xFF00);
+        imf_regKey  =  imf_rec[2];
+        imf_regVal  =  imf_rec[3];
 
-        if((imf_delay > 0) || (imf_length == 0))
+        if((imf_delay > 0) || ((imf_length == 0) && (imf_blockPos == imf_blockSize)))
         {
-            /*Store note events*/
-            for(c = 0; c <= 8; c++)
+            if(BUF_mute && (st.tick >= cvt->range_from))
+            {
+                MIDI_writeRangeBegin(file_out, cvt, &st);
+                cvt->midi_delta = st.tick - cvt->range_from;
+            }
+
+            if((cvt->range_to > 0) && (st.tick >= cvt->range_to))
+            {
+                cvt->midi_delta -= st.tick - cvt->range_to;
+                break;
+            }
+
+            if(seekBuild && (imf_delay > 0))
+                seekAddPoint(cvt, &st, imf_blockFirst + IMF_blockOrigin[imf_blockPos - 1]);
+
+            if(resumable && (imf_delay > 0) && (st.tick >= resumeNext))
+            {
+                /* Snapshot describes the data which is already in the file */
+                fflushb(file_out);
+                resumeSave(cvt->path_out, inputHash, cvt, &st,
+                           imf_blockFirst + IMF_blockOrigin[imf_blockPos - 1], imf_instIdPrev);
+                resumeNext = st.tick + RESUME_INTERVAL;
+            }
+
+            if(incremental && (imf_delay > 0))
+                incrAddPoint(incrSettings, cvt, &st,
+                             imf_blockFirst + IMF_blockOrigin[imf_blockPos - 1], imf_instIdPrev);
+
+            /*Store note events of channels changed since the last delay*/
+            imf_dirty = st.imf_dirty;
+            st.imf_dirty = 0;
+            for(c = 0; imf_dirty != 0; c++, imf_dirty >>= 1)
             {
                 uint8_t noteKey = 0, multL, multH, wsL, wsH;
 
+                if(!(imf_dirty & 1))
+                    continue;
+
                 multL   = cvt->imf_instruments[c].reg20[0] & 0x0F;
                 multH   = cvt->imf_instruments[c].reg20[1] & 0x0F;
                 wsL     = cvt->imf_instruments[c].regE0[0] & 0x07;
                 wsH     = cvt->imf_instruments[c].regE0[1] & 0x07;
 
-                imf_keys[c] = hzToKey(imf_freq[c], imf_octs[c],
-                                  multL, multH,
-                                  wsL, wsH);
+                st.imf_keys[c] = hzToKey(st.imf_freq[c], st.imf_octs[c],
+                                     multL, multH,
+                                     wsL, wsH);
 
-                if(cvt->flag_usePitch && noteKey && imf_keys[imf_channel])
-                    makePitch(imf_pitchs, (int16_t)imf_freq[c], imf_channel);
+                if(cvt->flag_usePitch && noteKey && st.imf_keys[st.imf_channel])
+                    makePitch(st.imf_pitchs, (int16_t)st.imf_freq[c], st.imf_channel);
 
-                if( (imf_key_st[c] != imf_key_st_prev[c]) ||
-                    (imf_keys[c] != imf_keys_prev[c]))
+                if( (st.imf_key_st[c] != st.imf_key_st_prev[c]) ||
+                    (st.imf_keys[c] != st.imf_keys_prev[c]))
                 {
-                    if(imf_key_st[c])
+                    if(st.imf_key_st[c])
                     {
                         struct AdLibInstrument* inst1 = &cvt->imf_instruments[c];
                         struct AdLibInstrument* inst2 = &cvt->imf_instrumentsPrev[c];
                         uint8_t velLevel = cvt->imf_instruments[c].reg40[0] & 0x3F;
 
-                        if((imf_insChange[c]) && (instcmp(inst1 ,inst2) != 0) )
+                        uint16_t instId = INST_NONE;
+                        int      instChanged = 0;
+
+                        if(st.imf_insChange[c])
+                        {
+                            instId = instIntern(inst1);
+                            if(instId != INST_NONE)
+                                instChanged = (instId != imf_instIdPrev[c]);
+                            else /* Table of the song is full */
+                                instChanged = (instcmp(inst1 ,inst2) != 0);
+                        }
+
+                        if(instChanged)
                         {
                             uint8_t patch;
-                            printInst(inst1, imf_channel, log, inst_log);
-                            if(inst_table)
-                                patch = detectPatch(inst_table, inst1, log);
+                            printInst(inst1, st.imf_channel, cvt->flag_logInstruments);
+                            /* Detection table may give other patch to other carrier level */
+                            if((instId != INST_NONE) && (INST_cache[instId].patch >= 0) &&
+                               (INST_cache[instId].level == inst1->reg40[1]))
+                                patch = (uint8_t)INST_cache[instId].patch;
+                            else
+                            {
+                                patch = detectPatch(&INST_db, inst1, cvt->flag_fuzzyMatch);
+                                if(instId != INST_NONE)
+                                {
+                                    INST_cache[instId].patch = patch;
+                                    INST_cache[instId].level = inst1->reg40[1];
+                                }
+                            }
+                            if(cvt->flag_allocChannels)
+                                cvt->midi_voicePatch[c] = patch;
                             else
-                                patch = rand() % 128;
-                            MIDI_writePatchChangeEvent(file_out, cvt, cvt->midi_mapchannel[imf_channel], patch);
+                                MIDI_writePatchChangeEvent(file_out, cvt, cvt->midi_mapchannel[st.imf_channel], patch);
                             memcpy(inst2, inst1, sizeof(struct AdLibInstrument));
-                            imf_insChange[imf_channel] = 0;
+                            imf_instIdPrev[c] = instId;
+                            st.imf_insChange[st.imf_channel] = 0;
                         }
 
                         if(velLevel > (cvt->imf_instruments[c].reg40[1] & 0x3F))
                             velLevel = cvt->imf_instruments[c].reg40[1] & 0x3F;
-                        if(imf_keys_prev[c] != 0)/* Mute note in channel if already pressed! */
-                            MIDI_writeNoteOffEvent(file_out, cvt, cvt->midi_mapchannel[c], imf_keys_prev[c], 0);
+                        if(st.imf_keys_prev[c] != 0)/* Mute note in channel if already pressed! */
+                            MIDI_writeNoteOffEvent(file_out, cvt, cvt->midi_mapchannel[c], st.imf_keys_prev[c], 0);
 
-                        if((cvt->flag_usePitch) && (imf_pitchs[c] != imf_pitchs_prev[c]))
+                        if(cvt->flag_allocChannels)
+                            MIDI_allocChannel(file_out, cvt, &st, c);
+
+                        if((cvt->flag_usePitch) && (st.imf_pitchs[c] != st.imf_pitchs_prev[c]))
                         {
-                            MIDI_writePitchEvent(file_out, cvt, cvt->midi_mapchannel[c], imf_pitchs[c]);
-                            imf_pitchs_prev[c] = imf_pitchs[c];
+                            MIDI_writePitchEvent(file_out, cvt, cvt->midi_mapchannel[c], st.imf_pitchs[c]);
+                            st.imf_pitchs_prev[c] = st.imf_pitchs[c];
                         }
 
-                        MIDI_writeNoteOnEvent(file_out, cvt, cvt->midi_mapchannel[c], imf_keys[c], ((0x3f - velLevel) << 1) & 0xFF);
+                        MIDI_writeNoteOnEvent(file_out, cvt, cvt->midi_mapchannel[c], st.imf_keys[c], ((0x3f - velLevel) << 1) & 0xFF);
                     } else {
-                        if( imf_keys_prev[c] != 0)
-                            MIDI_writeNoteOffEvent(file_out, cvt, cvt->midi_mapchannel[c], imf_keys_prev[c], 0);
-                        imf_keys[c] = 0;
+                        if( st.imf_keys_prev[c] != 0)
+                            MIDI_writeNoteOffEvent(file_out, cvt, cvt->midi_mapchannel[c], st.imf_keys_prev[c], 0);
+                        st.imf_keys[c] = 0;
                     }
 
-                    imf_key_st_prev[c] = imf_key_st[c];
-                    imf_keys_prev[c] = imf_keys[c];
+                    st.imf_key_st_prev[c] = st.imf_key_st[c];
+                    st.imf_keys_prev[c] = st.imf_keys[c];
                 }
             }
 
             /*Store pitch change events*/
-            for(c = 0; c <= 8; c++)
+            for(c = 0; c < IMF2MID_CHANNELS; c++)
             {
-                makePitch(imf_pitchs, (int16_t)imf_freq[c], imf_channel);
-                if((cvt->flag_usePitch) && (imf_pitchs[c] != imf_pitchs_prev[c]))
+                makePitch(st.imf_pitchs, (int16_t)st.imf_freq[c], st.imf_channel);
+                if((cvt->flag_usePitch) && (st.imf_pitchs[c] != st.imf_pitchs_prev[c]))
                 {
-                    MIDI_writePitchEvent(file_out, cvt, cvt->midi_mapchannel[c], imf_pitchs[c]);
-                    imf_pitchs_prev[c] = imf_pitchs[c];
+                    MIDI_writePitchEvent(file_out, cvt, cvt->midi_mapchannel[c], st.imf_pitchs[c]);
+                    st.imf_pitchs_prev[c] = st.imf_pitchs[c];
                 }
             }
 
             /*Drop all captured events of this moment!*/
+            MIDI_flushEvents(file_out, cvt);
             MIDI_addDelta(cvt, imf_delay);
+            st.tick += imf_delay;
         }
 
         if((imf_regKey >= 0xA0) && (imf_regKey <= 0xA8))
         {
-            imf_channel = imf_regKey - 0xA0;
-            imf_freq[imf_channel] = (imf_freq[imf_channel] & 0x0F00) | (imf_regVal & 0xFF);
+            st.imf_channel = imf_regKey - 0xA0;
+            st.imf_freq[st.imf_channel] = (st.imf_freq[st.imf_channel] & 0x0F00) | (imf_regVal & 0xFF);
+            st.imf_dirty |= 1UL << st.imf_channel;
             continue;
         }
 
         if((imf_regKey >= 0xB0) && (imf_regKey <= 0xB8))
         {
             uint8_t isKeyOn = (imf_regVal >> 5) & 1;
-            uint8_t /*noteKey = 0,*/ multL, multH, wsL, wsH /*, velLevel*/;
-
-            multL   = cvt->imf_instruments[c].reg20[0] & 0x0F;
-            multH   = cvt->imf_instruments[c].reg20[1] & 0x0F;
-            wsL     = cvt->imf_instruments[c].regE0[0] & 0x07;
-            wsH     = cvt->imf_instruments[c].regE0[1] & 0x07;
-
-            imf_keys[c] = hzToKey(imf_freq[c], imf_octs[c],
-                                  multL, multH,
-                                  wsL, wsH);
-
-            imf_channel = imf_regKey - 0xB0;
-            imf_freq[imf_channel] = (imf_freq[imf_channel] & 0x00FF) | (uint16_t)((imf_regVal & 0x03) << 0x08);
-            imf_octs[imf_channel] = (imf_regVal >> 0x02) & 0x07;
+            st.imf_channel = imf_regKey - 0xB0;
+            st.imf_freq[st.imf_channel] = (st.imf_freq[st.imf_channel] & 0x00FF) | (uint16_t)((imf_regVal & 0x03) << 0x08);
+            st.imf_octs[st.imf_channel] = (imf_regVal >> 0x02) & 0x07;
 
             if(isKeyOn)
             {
-                if(imf_key_st_prev[imf_channel] && !imf_key_st[imf_channel])
-                    imf_key_st_prev[imf_channel] = 0;
+                if(st.imf_key_st_prev[st.imf_channel] && !st.imf_key_st[st.imf_channel])
+                    st.imf_key_st_prev[st.imf_channel] = 0;
             }
-            imf_key_st[imf_channel] = isKeyOn;
+            st.imf_key_st[st.imf_channel] = isKeyOn;
+            st.imf_dirty |= 1UL << st.imf_channel;
 
             /*
              * TODO: Add calculation of velocity for short notes which making expression
@@ -1319,88 +5521,148 @@ int Imf2MIDI_process(struct Imf2MIDI_CVT* cvt, int log)
 
         if((imf_regKey >= 0x20) && (imf_regKey <= 0x35))
         {
-            imf_channel = opl2_opChannel[(imf_regKey - 0x20) % 0x15];
-            cvt->imf_instruments[imf_channel].reg20[opl2_op[(imf_regKey - 0x20) % 0x15]] = imf_regVal;
-            imf_insChange[imf_channel] = 1;
+            st.imf_channel = opl2_opChannel[(imf_regKey - 0x20) % 0x15];
+            cvt->imf_instruments[st.imf_channel].reg20[opl2_op[(imf_regKey - 0x20) % 0x15]] = imf_regVal;
+            st.imf_insChange[st.imf_channel] = 1;
+            /* Frequency multiplier changes the key */
+            st.imf_dirty |= 1UL << st.imf_channel;
             continue;
         }
 
         if((imf_regKey >= 0x40) && (imf_regKey <= 0x55))
         {
             uint8_t op = opl2_op[(imf_regKey - 0x40) % 0x15];
-            uint8_t oldOp1 = cvt->imf_instruments[imf_channel].reg40[0];
-            imf_channel = opl2_opChannel[(imf_regKey - 0x40) % 0x15];
-            cvt->imf_instruments[imf_channel].reg40[op] = imf_regVal;
+            uint8_t oldOp1 = cvt->imf_instruments[st.imf_channel].reg40[0];
+            st.imf_channel = opl2_opChannel[(imf_regKey - 0x40) % 0x15];
+            cvt->imf_instruments[st.imf_channel].reg40[op] = imf_regVal;
             /* Don't notify about changed instrument on volume change */
             if((0 == op) && ((oldOp1 & 0xC0) != (imf_regVal & 0xC0)))
-                imf_insChange[imf_channel] = 1;
+                st.imf_insChange[st.imf_channel] = 1;
             continue;
         }
 
         if((imf_regKey >= 0x60) && (imf_regKey <= 0x75))
         {
-            imf_channel = opl2_opChannel[(imf_regKey - 0x60) % 0x15];
-            cvt->imf_instruments[imf_channel].reg60[opl2_op[(imf_regKey - 0x60) % 0x15]] = imf_regVal;
-            imf_insChange[imf_channel] = 1;
+            st.imf_channel = opl2_opChannel[(imf_regKey - 0x60) % 0x15];
+            cvt->imf_instruments[st.imf_channel].reg60[opl2_op[(imf_regKey - 0x60) % 0x15]] = imf_regVal;
+            st.imf_insChange[st.imf_channel] = 1;
             continue;
         }
 
         if((imf_regKey >= 0x80) && (imf_regKey <= 0x95))
         {
-            imf_channel = opl2_opChannel[(imf_regKey - 0x80) % 0x15];
-            cvt->imf_instruments[imf_channel].reg80[opl2_op[(imf_regKey - 0x80) % 0x15]] = imf_regVal;
-            imf_insChange[imf_channel] = 1;
+            st.imf_channel = opl2_opChannel[(imf_regKey - 0x80) % 0x15];
+            cvt->imf_instruments[st.imf_channel].reg80[opl2_op[(imf_regKey - 0x80) % 0x15]] = imf_regVal;
+            st.imf_insChange[st.imf_channel] = 1;
             continue;
         }
 
         if((imf_regKey >= 0xC0) && (imf_regKey <= 0xC8))
         {
-            imf_channel = imf_regKey - 0xC0;
-            cvt->imf_instruments[imf_channel].regC0 = imf_regVal;
-            imf_insChange[imf_channel] = 1;
+            st.imf_channel = imf_regKey - 0xC0;
+            cvt->imf_instruments[st.imf_channel].regC0 = imf_regVal;
+            st.imf_insChange[st.imf_channel] = 1;
             continue;
         }
 
         if((imf_regKey >= 0xE0) && (imf_regKey <= 0xF5))
         {
-            imf_channel = opl2_opChannel[(imf_regKey - 0xE0) % 0x15];
-            cvt->imf_instruments[imf_channel].regE0[opl2_op[(imf_regKey - 0xE0) % 0x15]] = imf_regVal;
-            imf_insChange[imf_channel] = 1;
+            st.imf_channel = opl2_opChannel[(imf_regKey - 0xE0) % 0x15];
+            cvt->imf_instruments[st.imf_channel].regE0[opl2_op[(imf_regKey - 0xE0) % 0x15]] = imf_regVal;
+            st.imf_insChange[st.imf_channel] = 1;
+            /* Wave select changes the key */
+            st.imf_dirty |= 1UL << st.imf_channel;
             continue;
         }
     }
 
+    /* The range begins after the end of the song */
+    if(BUF_mute)
+    {
+        BUF_mute = 0;
+        cvt->midi_delta = 0;
+        cvt->midi_eventCode = -1;
+        MIDI_queueCount = 0;
+        memset(st.imf_keys, 0, sizeof(st.imf_keys));
+    }
+
     /* Shut-up all stay-on notes */
-    for(c = 0; c <= 8; c++)
+    for(c = 0; c < IMF2MID_CHANNELS; c++)
     {
-        if(imf_keys[c] != 0)
-            MIDI_writeNoteOffEvent(file_out, cvt, cvt->midi_mapchannel[c], imf_keys[c], 0);
+        if(st.imf_keys[c] != 0)
+            MIDI_writeNoteOffEvent(file_out, cvt, cvt->midi_mapchannel[c], st.imf_keys[c], 0);
     }
 
     MIDI_endTrack(file_out, cvt);
     MIDI_closeHead(file_out, cvt);
 
-    if(log)
-    {
-        printf("=============================\n"
-               "   Work has been completed!\n"
-               "=============================\n\n");
-    }
+    logMessage(IMF2MID_LOG_INFO, "=============================\n");
+    logMessage(IMF2MID_LOG_INFO, "   Work has been completed!\n");
+    logMessage(IMF2MID_LOG_INFO, "=============================\n\n");
+
+    if(ARCH_file)
+        archiveEnd(cvt->midi_fileSize);
 
     res = 0;
+    journal = cvt->flag_update && !ARCH_file && (cvt->in_size == 0) && !ranged && (STATE_table != NULL);
+
+    if(seekBuild)
+        seekWrite(cvt->path_in, inputHash);
+
+    incrSave = incremental;
 
 quit:
+    BUF_mute = 0;
+    seekReset();
+
+    if(resumeData)
+        free(resumeData);
+
     if(file_in)
         fclose(file_in);
 
-    if(file_out)
+    if(file_out && (file_out != ARCH_file))
         fclose(file_out);
 
-    if(inst_log)
-        fclose(inst_log);
+    /* New file replaces the old one only when complete */
+    if(incrTemp)
+    {
+        if(res == 0)
+        {
+            remove(cvt->path_out);
+            if(rename(incrTemp, cvt->path_out) != 0)
+            {
+                logMessage(IMF2MID_LOG_ERROR, "Can't rename %s into %s!\n\n", incrTemp, cvt->path_out);
+                incrSave = 0;
+                res = 1;
+            }
+        }
+        else
+            remove(incrTemp);
+        free(incrTemp);
+    }
+
+    if(incrSave)
+        incrWrite(cvt, incrSettings, inputHash);
+    incrReset();
+
+    /* Snapshot is no longer needed for the complete file */
+    if(resumable && (res == 0))
+    {
+        resumeFile = resumePath(cvt->path_out);
+        if(resumeFile)
+        {
+            remove(resumeFile);
+            free(resumeFile);
+        }
+    }
+
+    /* Only a complete and closed file gets into the journal */
+    if(journal)
+        stateRecord(cvt->path_in, inputHash);
 
-    if(inst_table)
-        delete_hash(inst_table);
+    LOG_prefix = NULL;
+    fflush(stdout);
 
     if(path_out)
     {
@@ -1411,3 +5673,186 @@ quit:
 
     return res;
 }
+
+int Imf2MIDI_processGameArchive(struct Imf2MIDI_CVT *cvt, char *path_head, char *path_data, int log)
+{
+    FILE    *head, *data;
+    uint8_t *offsets = NULL;
+    long     headSize, dataSize;
+    uint32_t count, i, songs = 0;
+    char    *path_out = NULL;
+    size_t   baseLen;
+    int      res = 0;
+
+    logSetLevel(log);
+
+    head = fopen(path_head, "rb");
+    if(!head)
+    {
+        logMessage(IMF2MID_LOG_ERROR, "Can't open file %s for read!\n\n", path_head);
+        return 1;
+    }
+
+    fseek(head, 0, SEEK_END);
+    headSize = ftell(head);
+    fseek(head, 0, SEEK_SET);
+    count = (headSize > 0) ? (uint32_t)(headSize / 4) : 0;
+
+    if(count > 0)
+        offsets = (uint8_t *)malloc(count * 4);
+    if(!offsets || (fread(offsets, 4, count, head) != count))
+    {
+        logMessage(IMF2MID_LOG_ERROR, "Failed to read chunk offsets from %s!\n\n", path_head);
+        fclose(head);
+        if(offsets)
+            free(offsets);
+        return 1;
+    }
+    fclose(head);
+
+    data = fopen(path_data, "rb");
+    if(!data)
+    {
+        logMessage(IMF2MID_LOG_ERROR, "Can't open file %s for read!\n\n", path_data);
+        free(offsets);
+        return 1;
+    }
+    fseek(data, 0, SEEK_END);
+    dataSize = ftell(data);
+
+    /* Songs are named by the data file and index of the chunk */
+    baseLen = strlen(path_data);
+    if((baseLen >= 4) && (path_data[baseLen - 4] == '.'))
+        baseLen -= 4;
+    path_out = (char *)malloc(baseLen + 16);
+
+    for(i = 0; path_out && ((i + 1) < count); i++)
+    {
+        uint32_t start = readLE32buf(offsets + (i * 4));
+        uint32_t end   = readLE32buf(offsets + ((i + 1) * 4));
+        uint8_t  len[4];
+        uint32_t length;
+
+        if((end <= start) || (end > (uint32_t)dataSize) || ((end - start) < 8))
+            continue;
+
+        /* Only music chunks are starting with a length which fits the chunk */
+        fseek(data, (long)start, SEEK_SET);
+        if(fread(len, 1, 4, data) != 4)
+            continue;
+        length = readLE32buf(len);
+        if((length < 8) || ((length % 4) != 0) || (length > (end - start)))
+            continue;
+
+        memcpy(path_out, path_data, baseLen);
+        sprintf(path_out + baseLen, "_%03lu.mid", (unsigned long)i);
+
+        cvt->path_in   = path_data;
+        cvt->path_out  = path_out;
+        cvt->in_offset = (long)start;
+        cvt->in_size   = (long)(end - start);
+        res |= Imf2MIDI_process(cvt, log);
+        songs++;
+    }
+
+    cvt->path_out  = NULL;
+    cvt->in_offset = 0;
+    cvt->in_size   = 0;
+
+    fclose(data);
+    free(offsets);
+    if(path_out)
+        free(path_out);
+
+    logSetLevel(log);
+    logMessage(IMF2MID_LOG_INFO, "Found %lu songs in %lu chunks of \"%s\"\n",
+                (unsigned long)songs, (unsigned long)(count ? count - 1 : 0), path_data);
+    fflush(stdout);
+
+    return res;
+}
+
+int Imf2MIDI_scan(const char *path_in, struct Imf2MIDI_SongInfo *info, int log)
+{
+    FILE    *file_in = NULL;
+    uint32_t imf_length = 0;
+
+    logSetLevel(log);
+
+    file_in = fopen(path_in, "rb");
+    if(!file_in)
+    {
+        logMessage(IMF2MID_LOG_ERROR, "Can't open file %s for read!\n\n", path_in);
+        return 1;
+    }
+    setvbuf(file_in, NULL, _IONBF, 0);
+
+    imf_length = readLE32(file_in);
+    if(imf_length == 0)
+    {
+        logMessage(IMF2MID_LOG_ERROR, "Failed to read IMF length!\n\n");
+        fclose(file_in);
+        return 1;
+    }
+
+    logMessage(IMF2MID_LOG_INFO, "Scanning \"%s\"...\n", path_in);
+    scanSong(file_in, imf_length - 4, info, NULL);
+
+    fclose(file_in);
+    return 0;
+}
+
+int Imf2MIDI_discover(const char *path_in, int log)
+{
+    struct Imf2MIDI_SongInfo info;
+    return Imf2MIDI_scan(path_in, &info, log);
+}
+
+int Imf2MIDI_writeDiscovery(const char *path_out, int log)
+{
+    struct InstDatabase *db = instDbShared();
+    FILE    *out;
+    uint32_t i, written = 0;
+    char     key[INST_FP_SIZE * 2 + 1];
+
+    logSetLevel(log);
+
+    out = fopen(path_out, "w");
+    if(!out)
+    {
+        logMessage(IMF2MID_LOG_ERROR, "Can't open file %s for write!\n\n", path_out);
+        return 1;
+    }
+
+    if(DISC_count > 0)
+        qsort(DISC_entries, DISC_count, sizeof(struct DiscoveryEntry), discoveryCmp);
+
+    fprintf(out, "// Instruments missing in the detection table, found in %lu songs\n", (unsigned long)DISC_songs);
+    fprintf(out, "// Patches are guesses from the most similar known instruments\n");
+
+    for(i = 0; i < DISC_count; i++)
+    {
+        struct DiscoveryEntry *e = &DISC_entries[i];
+        int patch = 0, confidence = 0;
+
+        instKeyString(e->fp, key);
+        if(instDbFind(db, e->fp, key, &patch))
+            continue;
+
+        if(!instDbFindNearest(db, e->fp, &patch, &confidence))
+            patch = 0;
+
+        fprintf(out, "%s|%03d/songs %lu, uses %lu, confidence %d%%\n",
+                key, patch, (unsigned long)e->songs, (unsigned long)e->uses, confidence);
+        written++;
+    }
+
+    fclose(out);
+
+    logMessage(IMF2MID_LOG_INFO, "Found %lu instruments in %lu songs, %lu are new and written into \"%s\"\n",
+                (unsigned long)DISC_count, (unsigned long)DISC_songs,
+                (unsigned long)written, path_out);
+
+    discoveryReset();
+    return 0;
+}
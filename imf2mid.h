@@ -39,6 +39,11 @@ typedef signed long    int32_t;
 #include <stdint.h>
 #endif
 
+/* Count of melodic channels of the OPL2 chip which IMF files are written for */
+#define IMF2MID_CHANNELS    9
+/* Count of MIDI channels */
+#define IMF2MID_MIDI_CHANNELS 16
+
 struct AdLibInstrument
 {
     uint8_t reg20[2];
@@ -52,15 +57,20 @@ struct AdLibInstrument
 
 struct Imf2MIDI_CVT
 {
-    struct AdLibInstrument imf_instruments[9];
-    struct AdLibInstrument imf_instrumentsPrev[9];
+    struct AdLibInstrument imf_instruments[IMF2MID_CHANNELS];
+    struct AdLibInstrument imf_instrumentsPrev[IMF2MID_CHANNELS];
 
     /* MIDI props */
     double   midi_tempo;
     uint32_t midi_resolution;
-    uint8_t  midi_mapchannel[9];
-    uint32_t midi_lastpatch[9];
-    uint16_t midi_lastpitch[9];
+    uint8_t  midi_mapchannel[IMF2MID_CHANNELS];
+    uint32_t midi_lastpatch[IMF2MID_MIDI_CHANNELS];
+    uint16_t midi_lastpitch[IMF2MID_MIDI_CHANNELS];
+    /* Patch of the instrument of every IMF channel and the time of the last note on every MIDI channel */
+    uint8_t  midi_voicePatch[IMF2MID_CHANNELS];
+    uint32_t midi_channelUsed[IMF2MID_MIDI_CHANNELS];
+    /* Bits of keys sounding on every MIDI channel, kept by the optimized output */
+    uint8_t  midi_keysOn[IMF2MID_MIDI_CHANNELS * 16];
     uint32_t midi_trackBegin;
     uint32_t midi_pos;
     uint32_t midi_fileSize;
@@ -73,14 +83,71 @@ struct Imf2MIDI_CVT
     /* File paths */
     char    *path_in;
     char    *path_out;
+    /* Part of input file to convert, the whole file when size is zero */
+    long     in_offset;
+    long     in_size;
+    /* Part of the song to convert in ticks, zero "to" means until the end */
+    uint32_t range_from;
+    uint32_t range_to;
 
     /* Flags */
     int      flag_usePitch;
     int      flag_logInstruments;
+    int      flag_fuzzyMatch;
+    int      flag_logPrefix;
+    int      flag_update;
+    int      flag_seekIndex;
+    int      flag_resume;
+    int      flag_incremental;
+    int      flag_allocChannels;
+    int      flag_optimize;
+};
+
+/* Summary of the song gathered without converting it */
+struct Imf2MIDI_SongInfo
+{
+    uint32_t records;       /* Count of register writes */
+    uint32_t ticks;         /* Duration, one tick per MIDI clock of the converted file */
+    uint32_t notes[IMF2MID_CHANNELS]; /* Count of note-ons on every channel */
+    uint32_t instruments;   /* Count of different instruments */
 };
 
+/* Called for every song found in the catalog */
+typedef void (*Imf2MIDI_SongFound)(const char *path, struct Imf2MIDI_SongInfo *info, void *userData);
+
+/* Levels of logging: the "log" argument prints everything up to given level */
+#define IMF2MID_LOG_ERROR   0
+#define IMF2MID_LOG_WARN    1
+#define IMF2MID_LOG_INFO    2
+#define IMF2MID_LOG_DEBUG   3
+
 extern void Imf2MIDI_init(struct Imf2MIDI_CVT *cvt);
 extern int  Imf2MIDI_process(struct Imf2MIDI_CVT *cvt, int log);
+/* Converts all songs of the game archive (AUDIOHED and AUDIOT files) in place */
+extern int  Imf2MIDI_processGameArchive(struct Imf2MIDI_CVT *cvt, char *path_head, char *path_data, int log);
+/* Collects instruments used in the song without converting it */
+extern int  Imf2MIDI_discover(const char *path_in, int log);
+/* Same as Imf2MIDI_discover, but also gives the summary of the song */
+extern int  Imf2MIDI_scan(const char *path_in, struct Imf2MIDI_SongInfo *info, int log);
+/* Writes collected instruments missing in the detection table, most used first */
+extern int  Imf2MIDI_writeDiscovery(const char *path_out, int log);
+/* Makes next conversion load the instrument tables again */
+extern void Imf2MIDI_reloadTables(void);
+/* Makes all next conversions be stored into one tar archive instead of separate files */
+extern int  Imf2MIDI_openArchive(const char *path);
+extern int  Imf2MIDI_closeArchive(void);
+/* Makes all next catalogAdd calls update the catalog file, it gets written on close */
+extern int  Imf2MIDI_openCatalog(const char *path);
+extern int  Imf2MIDI_catalogAdd(const char *path_in, int log);
+extern int  Imf2MIDI_closeCatalog(void);
+/* Finds songs of the catalog using the instrument given by its fingerprint in hex */
+extern int  Imf2MIDI_catalogFindInstrument(const char *path_catalog, const char *fingerprint,
+                                           Imf2MIDI_SongFound found, void *userData);
+/* Finds songs of the catalog with duration in given range of ticks, shortest first */
+extern int  Imf2MIDI_catalogFindDuration(const char *path_catalog, uint32_t minTicks, uint32_t maxTicks,
+                                         Imf2MIDI_SongFound found, void *userData);
+/* Frees instrument tables shared by all conversions */
+extern void Imf2MIDI_shutdown(void);
 
 
 #endif /* CONVERTER_H */
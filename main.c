@@ -52,6 +52,70 @@ static int isFileExists(char* filePath)
     return 1;
 }
 
+/**
+ * @brief Checks does the file belong to the shard of this run
+ * @param path path to the file as given
+ * @param shard index of the shard
+ * @param shards count of shards, 0 if sharding is disabled
+ * @return 1 if file should be processed
+ */
+static int isInShard(const char *path, unsigned long shard, unsigned long shards)
+{
+    unsigned long h = 2166136261UL;
+
+    if(shards == 0)
+        return 1;
+
+    while(*path)
+    {
+        h ^= (unsigned char)*path++;
+        h = (h * 16777619UL) & 0xFFFFFFFFUL;
+    }
+
+    return (h % shards) == shard;
+}
+
+/**
+ * @brief Prints the summary of the song as one line of a table
+ * @param cvt converter context, gives the tempo of converted files
+ * @param path path to the song
+ * @param info summary of the song
+ */
+static void printSongInfo(struct Imf2MIDI_CVT *cvt, const char *path, struct Imf2MIDI_SongInfo *info)
+{
+    double seconds = (double)info->ticks * 60.0 / (cvt->midi_tempo * (double)cvt->midi_resolution);
+    int c;
+
+    printf("%s\t%lu\t%.2f\t%lu\t%lu\t", path,
+           (unsigned long)info->ticks, seconds,
+           (unsigned long)info->records, (unsigned long)info->instruments);
+    for(c = 0; c < IMF2MID_CHANNELS; c++)
+        printf(c ? ",%lu" : "%lu", (unsigned long)info->notes[c]);
+    printf("\n");
+}
+
+/* Prints the song found in the catalog */
+static void printFoundSong(const char *path, struct Imf2MIDI_SongInfo *info, void *userData)
+{
+    printSongInfo((struct Imf2MIDI_CVT *)userData, path, info);
+}
+
+/**
+ * @brief Converts duration in seconds into ticks of the converted song
+ * @param cvt converter context, gives the tempo of converted files
+ * @param seconds duration in seconds
+ * @return duration in ticks
+ */
+static uint32_t secondsToTicks(struct Imf2MIDI_CVT *cvt, double seconds)
+{
+    double ticks = seconds * cvt->midi_tempo * (double)cvt->midi_resolution / 60.0;
+    if(ticks <= 0.0)
+        return 0;
+    if(ticks >= 4294967295.0)
+        return 0xFFFFFFFFUL;
+    return (uint32_t)ticks;
+}
+
 #define VERSION_STRING "\x1b[32mIMF2MID version " IMF2MID_VERSION "\x1b[0m"
 
 /**
@@ -66,19 +130,134 @@ static int printUsage(void)
            "More detail information and source code here:\n"
            "      https://github.com/Wohlstand/imf2mid\n\n");
     printf("  \x1b[31mUsage:\x1b[0m\n");
-    printf("     ./imf2mid \x1b[37m[option]\x1b[0m \x1b[32mfilename.imf\x1b[0m \x1b[37m[filename.mid]\x1b[0m\n\n");
+    printf("     ./imf2mid \x1b[37m[option]\x1b[0m \x1b[32mfilename.imf\x1b[0m \x1b[37m[filename.mid]\x1b[0m\n");
+    printf("     ./imf2mid \x1b[37m[option]\x1b[0m -b \x1b[32mfile1.imf file2.imf ...\x1b[0m\n");
+    printf("     ./imf2mid -di \x1b[32mfile1.imf file2.imf ...\x1b[0m\n");
+    printf("     ./imf2mid \x1b[37m[option]\x1b[0m -ga \x1b[32mAUDIOHED.EXT AUDIOT.EXT\x1b[0m\n\n");
     printf(" -np   - ignore pitch change events\n");
     printf(" -nl   - disable printing log\n");
+    printf(" -lb   - brief log: print progress only, without details of instruments\n");
     printf(" -li   - write dump of detected instruments into \"instlog.txt\" file\n");
+    printf(" -fz   - use the most similar known instrument instead of a random one\n");
+    printf(" -ac   - put notes of the same instrument into one MIDI channel, which makes\n"
+           "         less patch changes\n");
+    printf(" -op   - optimize MIDI events: drop the ones which change nothing and order\n"
+           "         the rest of every moment so more status bytes are left out\n");
+    printf(" -di   - don't convert, but write instruments of all given files which are\n"
+           "         missing in the detection table into \"discovery.txt\" file\n");
+    printf(" --scan - don't convert, but print duration, count of records, instruments\n"
+           "         and notes on every channel of all given files as a table\n");
+    printf(" -ci catalog.bin - don't convert, but add summaries of all given files into\n"
+           "         the catalog, only changed files are scanned again\n");
+    printf(" --query-inst catalog.bin FINGERPRINT - print songs of the catalog which use\n"
+           "         the instrument, given by 22 hex digits like in the \"regtable.txt\"\n");
+    printf(" --query-length catalog.bin MIN:MAX - print songs of the catalog with duration\n"
+           "         between MIN and MAX seconds, MAX may be omitted\n");
+    printf(" --from SEC, --to SEC - convert only the part of the song between given seconds\n");
+    printf(" -si   - write the seek index next to the song, which makes --from fast\n");
+    printf(" -r    - resumable conversion: keep a snapshot of conversion next to the MIDI\n"
+           "         file, so the interrupted conversion continues from it next time\n");
+    printf(" -inc  - incremental conversion: keep snapshots of conversion next to the MIDI\n"
+           "         file, so only the part after the first change of the song is converted\n");
+    printf(" --serve - convert files requested by lines from standard input:\n"
+           "         \"convert file.imf[<TAB>file.mid]\", \"reload\" and \"quit\"\n");
+    printf(" -u    - update mode: skip files which weren't changed since last conversion\n");
+    printf(" --shard i/N - process only i-th of N parts of the given files,\n"
+           "         every file always gets into the same part\n");
+    printf(" -a file.tar - store all converted files into one tar archive,\n"
+           "         with offsets of every file written into \"file.tar.idx\"\n");
+    printf(" -ga   - convert all songs stored in the game's audio archive\n");
+    printf(" -b    - batch mode: convert every given file into a MIDI file next to it\n");
     printf("\n\n");
 
     return 1;
 }
 
+/**
+ * @brief Converts one file of the batch
+ * @param cvt converter context
+ * @param path path to the source file
+ * @param logging level of the log
+ * @return 0 on success, 1 on failure
+ */
+static int convertBatchFile(struct Imf2MIDI_CVT *cvt, char *path, int logging)
+{
+    /* Missing files are reported by converter, don't open every file twice */
+    cvt->path_in  = path;
+    cvt->path_out = NULL;
+    return Imf2MIDI_process(cvt, logging);
+}
+
+/**
+ * @brief Serves conversion requests read from the standard input
+ * @param cvt converter context
+ * @return 0 when input was closed or "quit" command received
+ *
+ * Every request is a line, and every reply is a line too:
+ *   convert <file.imf>[<TAB><file.mid>]  - replies "OK" or "ERR <reason>"
+ *   reload                               - reloads instrument tables, replies "OK"
+ *   quit                                 - stops serving
+ * The log goes into stderr to keep stdout for replies only.
+ */
+static int serveRequests(struct Imf2MIDI_CVT *cvt)
+{
+    char line[1024];
+
+    while(fgets(line, sizeof(line), stdin))
+    {
+        size_t len = strlen(line);
+        char *arg, *out;
+
+        while((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == '\r')))
+            line[--len] = '\0';
+
+        arg = strchr(line, ' ');
+        if(arg)
+            *arg++ = '\0';
+
+        if(mystricmp(line, "quit") == 0)
+            break;
+        else
+        if(mystricmp(line, "reload") == 0)
+        {
+            Imf2MIDI_reloadTables();
+            printf("OK\n");
+        }
+        else
+        if((mystricmp(line, "convert") == 0) && arg && *arg)
+        {
+            out = strchr(arg, '\t');
+            if(out)
+                *out++ = '\0';
+
+            if(!isFileExists(arg))
+                printf("ERR Source file %s is invalid\n", arg);
+            else
+            {
+                cvt->path_in  = arg;
+                cvt->path_out = (out && *out) ? out : NULL;
+                if(Imf2MIDI_process(cvt, IMF2MID_LOG_WARN) == 0)
+                    printf("OK\n");
+                else
+                    printf("ERR Failed to convert %s\n", arg);
+            }
+        }
+        else
+            printf("ERR Unknown command %s\n", line);
+
+        fflush(stdout);
+    }
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     struct Imf2MIDI_CVT cvt;
-    int logging = 1, noOptions = 0;
+    int logging = IMF2MID_LOG_DEBUG, noOptions = 0, batch = 0, discover = 0, scan = 0, serve = 0, ret = 0;
+    unsigned long shard = 0, shards = 0;
+    int gameArchive = 0, catalog = 0;
+    char *path_head = NULL, *path_data = NULL;
 
     if(argc <= 1)
         return printUsage();
@@ -86,6 +265,9 @@ int main(int argc, char **argv)
     argv++;
     argc--;
 
+    /* Write the log by large blocks, the converter flushes it after every file */
+    setvbuf(stdout, NULL, _IOFBF, 4096);
+
     Imf2MIDI_init(&cvt);
 
     while(argc > 0)
@@ -105,7 +287,128 @@ int main(int argc, char **argv)
                 cvt.flag_logInstruments = 1;
             else
             if(mystricmp(*argv, "-nl") == 0)
-                logging = 0;
+                logging = IMF2MID_LOG_WARN;
+            else
+            if(mystricmp(*argv, "-lb") == 0)
+                logging = IMF2MID_LOG_INFO;
+            else
+            if(mystricmp(*argv, "-fz") == 0)
+                cvt.flag_fuzzyMatch = 1;
+            else
+            if(mystricmp(*argv, "-b") == 0)
+            {
+                batch = 1;
+                cvt.flag_logPrefix = 1;
+            }
+            else
+            if(mystricmp(*argv, "-di") == 0)
+                discover = 1;
+            else
+            if(mystricmp(*argv, "-ga") == 0)
+                gameArchive = 1;
+            else
+            if(mystricmp(*argv, "--scan") == 0)
+            {
+                scan = 1;
+                printf("# file\tticks\tseconds\trecords\tinstruments\tnotes\n");
+            }
+            else
+            if(mystricmp(*argv, "--serve") == 0)
+                serve = 1;
+            else
+            if(mystricmp(*argv, "-u") == 0)
+                cvt.flag_update = 1;
+            else
+            if(mystricmp(*argv, "-a") == 0)
+            {
+                if(argc < 2)
+                    return printUsage();
+                if(Imf2MIDI_openArchive(argv[1]) != 0)
+                    return 1;
+                argv++;
+                argc--;
+            }
+            else
+            if(mystricmp(*argv, "-ci") == 0)
+            {
+                if(argc < 2)
+                    return printUsage();
+                if(Imf2MIDI_openCatalog(argv[1]) != 0)
+                    return 1;
+                catalog = 1;
+                argv++;
+                argc--;
+            }
+            else
+            if(mystricmp(*argv, "--query-inst") == 0)
+            {
+                if(argc < 3)
+                    return printUsage();
+                printf("# file\tticks\tseconds\trecords\tinstruments\tnotes\n");
+                ret = Imf2MIDI_catalogFindInstrument(argv[1], argv[2], printFoundSong, &cvt);
+                Imf2MIDI_shutdown();
+                return ret;
+            }
+            else
+            if(mystricmp(*argv, "--query-length") == 0)
+            {
+                double minSec = 0.0, maxSec = 0.0;
+                int got;
+                if((argc < 3) || ((got = sscanf(argv[2], "%lf:%lf", &minSec, &maxSec)) < 1))
+                    return printUsage();
+                printf("# file\tticks\tseconds\trecords\tinstruments\tnotes\n");
+                ret = Imf2MIDI_catalogFindDuration(argv[1], secondsToTicks(&cvt, minSec),
+                                                   (got > 1) ? secondsToTicks(&cvt, maxSec) : 0xFFFFFFFFUL,
+                                                   printFoundSong, &cvt);
+                Imf2MIDI_shutdown();
+                return ret;
+            }
+            else
+            if(mystricmp(*argv, "-si") == 0)
+                cvt.flag_seekIndex = 1;
+            else
+            if(mystricmp(*argv, "-r") == 0)
+                cvt.flag_resume = 1;
+            else
+            if(mystricmp(*argv, "-inc") == 0)
+                cvt.flag_incremental = 1;
+            else
+            if(mystricmp(*argv, "-ac") == 0)
+                cvt.flag_allocChannels = 1;
+            else
+            if(mystricmp(*argv, "-op") == 0)
+                cvt.flag_optimize = 1;
+            else
+            if((mystricmp(*argv, "--from") == 0) || (mystricmp(*argv, "--to") == 0))
+            {
+                double sec = 0.0;
+                if((argc < 2) || (sscanf(argv[1], "%lf", &sec) != 1) || (sec < 0.0))
+                    return printUsage();
+                if(mystricmp(*argv, "--from") == 0)
+                    cvt.range_from = secondsToTicks(&cvt, sec);
+                else
+                    cvt.range_to = secondsToTicks(&cvt, sec);
+                /* Checked here, before batch mode converts anything with the range */
+                if((cvt.range_to > 0) && (cvt.range_to <= cvt.range_from))
+                {
+                    fprintf(stderr, "\x1b[31mERROR:\x1b[0m End of the range must be after its begin!\n\n");
+                    return printUsage();
+                }
+                argv++;
+                argc--;
+            }
+            else
+            if(mystricmp(*argv, "--shard") == 0)
+            {
+                if((argc < 2) || (sscanf(argv[1], "%lu/%lu", &shard, &shards) != 2) ||
+                   (shards == 0) || (shard >= shards))
+                {
+                    fprintf(stderr, "\x1b[31mERROR:\x1b[0m Shard must be given as i/N, where i is less than N!\n\n");
+                    return printUsage();
+                }
+                argv++;
+                argc--;
+            }
             else
             {
                 noOptions = 1;
@@ -113,7 +416,39 @@ int main(int argc, char **argv)
             }
         }
         else
+        if((batch || discover || scan || catalog) && !isInShard(*argv, shard, shards))
+        {
+            /* Processed by another run */
+        }
+        else
+        if(gameArchive)
+        {
+            if(!path_head)
+                path_head = *argv;
+            else
+            if(!path_data)
+                path_data = *argv;
+        }
+        else
         {
+            if(catalog)
+                ret |= Imf2MIDI_catalogAdd(*argv, logging);
+            else
+            if(scan)
+            {
+                struct Imf2MIDI_SongInfo info;
+                if(Imf2MIDI_scan(*argv, &info, IMF2MID_LOG_WARN) == 0)
+                    printSongInfo(&cvt, *argv, &info);
+                else
+                    ret = 1;
+            }
+            else
+            if(discover)
+                ret |= Imf2MIDI_discover(*argv, logging);
+            else
+            if(batch)
+                ret |= convertBatchFile(&cvt, *argv, logging);
+            else
             if(!cvt.path_in)
             {
                 if(!isFileExists(*argv))
@@ -134,5 +469,33 @@ int main(int argc, char **argv)
         argc--;
     }
 
-    return Imf2MIDI_process(&cvt, logging);
+    if(gameArchive)
+    {
+        if(!path_head || !path_data)
+            return printUsage();
+        ret = Imf2MIDI_processGameArchive(&cvt, path_head, path_data, logging);
+    }
+    else
+    if(serve)
+        ret = serveRequests(&cvt);
+    else
+    if(scan || catalog)
+    {
+        /* Nothing to write, catalog is written on close */
+    }
+    else
+    if(discover)
+        ret |= Imf2MIDI_writeDiscovery("discovery.txt", logging);
+    else
+    if(!batch)
+        ret = Imf2MIDI_process(&cvt, logging);
+
+    if(Imf2MIDI_closeArchive() != 0)
+        ret = 1;
+
+    if(Imf2MIDI_closeCatalog() != 0)
+        ret = 1;
+
+    Imf2MIDI_shutdown();
+    return ret;
 }
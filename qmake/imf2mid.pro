@@ -12,6 +12,7 @@ SOURCES += \
     ../imf2mid.c
 
 HEADERS += \
-    ../imf2mid.h
+    ../imf2mid.h \
+    ../regtable.h
 
 
@@ -0,0 +1,12 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG -= qt
+
+TARGET = regconv
+DESTDIR = $$PWD/../bin
+
+QMAKE_CFLAGS += -ansi
+
+SOURCES += \
+    ../tools/regconv.c
+
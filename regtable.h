@@ -0,0 +1,56 @@
+/*
+ * Built-in instrument detection table of IMF2MID
+ *
+ * Generated by tools/regconv from bin/regtable.txt, don't edit!
+ */
+
+#ifndef REGTABLE_H
+#define REGTABLE_H
+
+#define REGTABLE_COUNT      24
+#define REGTABLE_BUCKETS    7
+#define REGTABLE_DIRECT     0x80000000UL
+
+static const uint32_t regtable_disp[REGTABLE_BUCKETS] =
+{
+    0x00000007, 0x00000002, 0x0000000E, 0x80000003, 0x80000006, 0x0000015D,
+    0x00000003
+};
+
+static const uint8_t regtable_keys[REGTABLE_COUNT + 1][11] =
+{
+    {0x24,0x00,0x40,0x00,0x55,0x00,0x55,0x00,0x0E,0x00,0x00},
+    {0x61,0x00,0x00,0x00,0x53,0x00,0x53,0x00,0x0C,0x00,0x00},
+    {0x30,0x00,0x00,0x00,0x71,0x00,0x71,0x00,0x0E,0x00,0x00},
+    {0x61,0x00,0x00,0x00,0x73,0x00,0x73,0x00,0x0C,0x00,0x00},
+    {0x05,0x00,0x40,0x00,0xDA,0x00,0xDA,0x00,0x0A,0x00,0x00},
+    {0x00,0x00,0x00,0x1A,0xA8,0xD6,0xA8,0xD6,0x00,0x00,0x00},
+    {0x06,0x00,0x00,0x1F,0xF0,0xF7,0xF0,0xF7,0x0E,0x00,0x00},
+    {0x21,0x00,0x80,0x00,0x53,0x00,0x53,0x00,0x0E,0x00,0x00},
+    {0x01,0x01,0x40,0x1A,0xF1,0xD3,0xF1,0xD3,0x06,0x00,0x00},
+    {0x01,0x01,0x40,0x1A,0xF1,0x50,0xF1,0x50,0x06,0x00,0x00},
+    {0x01,0x21,0x00,0x91,0xD4,0xC4,0xD4,0xC4,0x0A,0x00,0x00},
+    {0x31,0x00,0x40,0x00,0xF2,0x00,0xF2,0x00,0x06,0x00,0x00},
+    {0x05,0x00,0x00,0x1F,0xF0,0xFA,0xF0,0xFA,0x0E,0x00,0x00},
+    {0x31,0x00,0xC0,0x00,0x87,0x00,0x87,0x00,0x02,0x00,0x00},
+    {0x02,0x00,0x00,0x00,0xF5,0x00,0xF5,0x00,0x00,0x00,0x00},
+    {0x00,0x00,0x00,0x1B,0xE8,0xA5,0xE8,0xA5,0x06,0x00,0x00},
+    {0x32,0x00,0x00,0x00,0x82,0x00,0x82,0x00,0x0C,0x00,0x00},
+    {0xA1,0xE2,0x00,0x99,0xD6,0x60,0xD6,0x60,0x02,0x00,0x00},
+    {0x30,0x21,0x00,0x0F,0x73,0x80,0x73,0x80,0x0E,0x00,0x00},
+    {0x31,0x00,0x40,0x00,0xF1,0x00,0xF1,0x00,0x06,0x00,0x00},
+    {0x2C,0x00,0xC0,0x00,0xF9,0x00,0xF9,0x00,0x00,0x00,0x00},
+    {0x07,0x00,0x00,0x1F,0xF0,0x5C,0xF0,0x5C,0x0E,0x00,0x00},
+    {0x70,0x22,0x80,0x19,0x6E,0x6B,0x6E,0x6B,0x02,0x00,0x00},
+    {0x06,0x00,0x00,0x15,0xF0,0xF7,0xF0,0xF7,0x0E,0x00,0x00},
+    {0,0,0,0,0,0,0,0,0,0,0}
+};
+
+static const uint8_t regtable_patch[REGTABLE_COUNT + 1] =
+{
+    57,73,69,69,71,117,127,10,5,60,35,4,121,8,57,117,
+    71,71,38,2,57,119,68,127,
+    0
+};
+
+#endif /* REGTABLE_H */
@@ -0,0 +1,463 @@
+/*
+ * IMF2MIDI - a small utility to convert IMF music files into General MIDI
+ *
+ * Copyright (c) 2016-2018 Vitaly Novichkov <admin@wohlnet.ru>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * REGCONV - converts an instrument detection table (regtable.txt)
+ * into a C header with a minimal perfect hash over the instrument
+ * fingerprints which gets built into the IMF2MID binary, or into
+ * the binary instrument database (regtable.bin).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../imf2mid.h"
+
+#define FP_SIZE     11
+#define LINE_SIZE   101
+
+struct RegEntry
+{
+    uint8_t key[FP_SIZE];
+    int     patch;
+    size_t  seq;
+};
+
+static struct RegEntry *g_entries = NULL;
+static size_t           g_count   = 0;
+static size_t           g_alloc   = 0;
+
+/* Must match the instHash() in imf2mid.c */
+static uint32_t regHash(const uint8_t *key, uint32_t seed)
+{
+    uint32_t h = 2166136261UL ^ seed;
+    size_t   i;
+
+    for(i = 0; i < FP_SIZE; i++)
+    {
+        h ^= key[i];
+        h *= 16777619UL;
+    }
+
+    h ^= h >> 15;
+    h *= 0x2C1B3C6DUL;
+    h ^= h >> 12;
+    return h;
+}
+
+static int hexDigit(char c)
+{
+    if((c >= '0') && (c <= '9'))
+        return c - '0';
+    if((c >= 'A') && (c <= 'F'))
+        return c - 'A' + 10;
+    if((c >= 'a') && (c <= 'f'))
+        return c - 'a' + 10;
+    return -1;
+}
+
+static int parseKey(const char *str, uint8_t *key)
+{
+    size_t i;
+
+    for(i = 0; i < FP_SIZE; i++)
+    {
+        int hi = hexDigit(str[i * 2]);
+        int lo = hexDigit(str[i * 2 + 1]);
+        if((hi < 0) || (lo < 0))
+            return 0;
+        key[i] = (uint8_t)((hi << 4) | lo);
+    }
+
+    return 1;
+}
+
+static void addEntry(const uint8_t *key, int patch)
+{
+    if(g_count >= g_alloc)
+    {
+        g_alloc = g_alloc ? (g_alloc * 2) : 256;
+        g_entries = (struct RegEntry *)realloc(g_entries, g_alloc * sizeof(struct RegEntry));
+        if(!g_entries)
+        {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+    }
+
+    memcpy(g_entries[g_count].key, key, FP_SIZE);
+    g_entries[g_count].patch = patch;
+    g_entries[g_count].seq = g_count;
+    g_count++;
+}
+
+static int entrycmp(const void *a, const void *b)
+{
+    const struct RegEntry *e1 = (const struct RegEntry *)a;
+    const struct RegEntry *e2 = (const struct RegEntry *)b;
+    int cmp = memcmp(e1->key, e2->key, FP_SIZE);
+
+    if(cmp != 0)
+        return cmp;
+
+    return (e1->seq < e2->seq) ? -1 : ((e1->seq > e2->seq) ? 1 : 0);
+}
+
+/* Sorts entries by the key, same as the hash table of the converter, the last value wins */
+static void sortEntries(void)
+{
+    size_t i, j;
+
+    if(g_count == 0)
+        return;
+
+    qsort(g_entries, g_count, sizeof(struct RegEntry), entrycmp);
+
+    for(i = 1, j = 0; i < g_count; i++)
+    {
+        if(memcmp(g_entries[i].key, g_entries[j].key, FP_SIZE) != 0)
+            j++;
+        g_entries[j] = g_entries[i];
+    }
+
+    g_count = j + 1;
+}
+
+/* Parses the table exactly like loadInstMap() of the converter does */
+static int loadTable(const char *path)
+{
+    char  line[LINE_SIZE + 1];
+    FILE *f = fopen(path, "r");
+    int   lineNum = 0;
+
+    if(!f)
+    {
+        fprintf(stderr, "Can't open %s for read!\n", path);
+        return 0;
+    }
+
+    while(fgets(line, LINE_SIZE, f))
+    {
+        size_t  len = strlen(line);
+        char   *comment = strrchr(line, '/');
+        uint8_t key[FP_SIZE];
+
+        lineNum++;
+
+        if(comment)
+            *comment = '\0';
+
+        if(len < 26)
+            continue;
+
+        if(!parseKey(line, key))
+        {
+            fprintf(stderr, "%s:%d: invalid fingerprint, skipped\n", path, lineNum);
+            continue;
+        }
+
+        addEntry(key, atoi(line + 23));
+    }
+
+    fclose(f);
+    sortEntries();
+    return 1;
+}
+
+static size_t *qsortBuckets = NULL;
+
+static int bucketcmp(const void *a, const void *b)
+{
+    size_t b1 = *(const size_t *)a;
+    size_t b2 = *(const size_t *)b;
+    size_t n1 = qsortBuckets[b1 + 1] - qsortBuckets[b1];
+    size_t n2 = qsortBuckets[b2 + 1] - qsortBuckets[b2];
+
+    if(n1 != n2)
+        return (n1 > n2) ? -1 : 1;
+
+    return (b1 < b2) ? -1 : ((b1 > b2) ? 1 : 0);
+}
+
+/**
+ * @brief Builds "hash and displace" minimal perfect hash
+ * @param buckets count of buckets
+ * @param disp array of displacements per bucket
+ * @param slots array of entry indices per slot
+ * @return 1 on success, 0 if no displacement was found for some bucket
+ *
+ * Buckets with a single key are placed at the end into any free slot
+ * which is stored directly with the REGTABLE_DIRECT flag.
+ */
+static int buildHash(size_t buckets, uint32_t *disp, size_t *slots)
+{
+    size_t *bucketOf = (size_t *)malloc((g_count + 1) * sizeof(size_t));
+    size_t *order    = (size_t *)malloc((buckets + 1) * sizeof(size_t));
+    size_t *first    = (size_t *)calloc(buckets + 1, sizeof(size_t));
+    size_t *members  = (size_t *)malloc((g_count + 1) * sizeof(size_t));
+    size_t *fill     = (size_t *)calloc(buckets + 1, sizeof(size_t));
+    char   *used     = (char *)calloc(g_count + 1, 1);
+    size_t  i, j, k;
+    size_t  freeSlot = 0;
+    int     ok = 1;
+
+    if(!bucketOf || !order || !first || !members || !fill || !used)
+    {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+
+    /* Group entries by buckets: members[first[b] .. first[b + 1]) */
+    for(i = 0; i < g_count; i++)
+    {
+        bucketOf[i] = regHash(g_entries[i].key, 0) % buckets;
+        first[bucketOf[i] + 1]++;
+    }
+    for(i = 0; i < buckets; i++)
+        first[i + 1] += first[i];
+    for(i = 0; i < g_count; i++)
+        members[first[bucketOf[i]] + fill[bucketOf[i]]++] = i;
+
+    for(i = 0; i < g_count; i++)
+        slots[i] = (size_t)-1;
+
+    /* Place the biggest buckets first */
+    for(i = 0; i < buckets; i++)
+        order[i] = i;
+    qsortBuckets = first;
+    qsort(order, buckets, sizeof(size_t), bucketcmp);
+
+    for(i = 0; (i < buckets) && ok; i++)
+    {
+        size_t   b = order[i];
+        size_t   n = first[b + 1] - first[b];
+        size_t  *m = members + first[b];
+        uint32_t d;
+
+        disp[b] = 0;
+        if(n == 0)
+            continue;
+
+        if(n == 1)
+        {
+            while(used[freeSlot])
+                freeSlot++;
+            used[freeSlot] = 1;
+            slots[freeSlot] = m[0];
+            disp[b] = 0x80000000UL | (uint32_t)freeSlot;
+            continue;
+        }
+
+        for(d = 1; d <= 0xFFFF; d++)
+        {
+            for(j = 0; j < n; j++)
+            {
+                size_t s = regHash(g_entries[m[j]].key, d) % g_count;
+                if(used[s])
+                    break;
+                used[s] = 1;
+                slots[s] = m[j];
+            }
+
+            if(j == n)
+                break;
+
+            /* Roll back partially placed bucket */
+            for(k = 0; k < j; k++)
+            {
+                size_t s = regHash(g_entries[m[k]].key, d) % g_count;
+                used[s] = 0;
+                slots[s] = (size_t)-1;
+            }
+        }
+
+        if(d > 0xFFFF)
+            ok = 0;
+        else
+            disp[b] = d;
+    }
+
+    free(bucketOf);
+    free(order);
+    free(first);
+    free(members);
+    free(fill);
+    free(used);
+    return ok;
+}
+
+static int writeHeader(const char *path, const char *source)
+{
+    size_t    buckets = (g_count / 4) + 1;
+    uint32_t *disp;
+    size_t   *slots;
+    size_t    i, j;
+    FILE     *f;
+
+    for(;;)
+    {
+        disp  = (uint32_t *)calloc(buckets, sizeof(uint32_t));
+        slots = (size_t *)malloc((g_count + 1) * sizeof(size_t));
+        if(!disp || !slots)
+        {
+            fprintf(stderr, "Out of memory!\n");
+            return 0;
+        }
+
+        if((g_count == 0) || buildHash(buckets, disp, slots))
+            break;
+
+        free(disp);
+        free(slots);
+        buckets *= 2;
+    }
+
+    f = fopen(path, "w");
+    if(!f)
+    {
+        fprintf(stderr, "Can't open %s for write!\n", path);
+        free(disp);
+        free(slots);
+        return 0;
+    }
+
+    fprintf(f, "/*\n"
+               " * Built-in instrument detection table of IMF2MID\n"
+               " *\n"
+               " * Generated by tools/regconv from %s, don't edit!\n"
+               " */\n\n", source);
+    fprintf(f, "#ifndef REGTABLE_H\n#define REGTABLE_H\n\n");
+    fprintf(f, "#define REGTABLE_COUNT      %lu\n", (unsigned long)g_count);
+    fprintf(f, "#define REGTABLE_BUCKETS    %lu\n", (unsigned long)buckets);
+    fprintf(f, "#define REGTABLE_DIRECT     0x80000000UL\n\n");
+
+    fprintf(f, "static const uint32_t regtable_disp[REGTABLE_BUCKETS] =\n{");
+    for(i = 0; i < buckets; i++)
+        fprintf(f, "%s0x%08lX%s", ((i % 6) == 0) ? "\n    " : " ", (unsigned long)disp[i], (i + 1 < buckets) ? "," : "");
+    fprintf(f, "\n};\n\n");
+
+    fprintf(f, "static const uint8_t regtable_keys[REGTABLE_COUNT + 1][11] =\n{\n");
+    for(i = 0; i < g_count; i++)
+    {
+        fprintf(f, "    {");
+        for(j = 0; j < FP_SIZE; j++)
+            fprintf(f, "0x%02X%s", g_entries[slots[i]].key[j], (j + 1 < FP_SIZE) ? "," : "");
+        fprintf(f, "},\n");
+    }
+    fprintf(f, "    {0,0,0,0,0,0,0,0,0,0,0}\n};\n\n");
+
+    fprintf(f, "static const uint8_t regtable_patch[REGTABLE_COUNT + 1] =\n{");
+    for(i = 0; i < g_count; i++)
+        fprintf(f, "%s%u,", ((i % 16) == 0) ? "\n    " : "", (unsigned)(g_entries[slots[i]].patch & 0xFF));
+    fprintf(f, "\n    0\n};\n\n");
+
+    fprintf(f, "#endif /* REGTABLE_H */\n");
+    fclose(f);
+
+    free(disp);
+    free(slots);
+    return 1;
+}
+
+static void writeLE16(FILE *f, uint16_t in)
+{
+    fputc(in & 0xFF, f);
+    fputc((in >> 8) & 0xFF, f);
+}
+
+static void writeLE32(FILE *f, uint32_t in)
+{
+    fputc(in & 0xFF, f);
+    fputc((in >> 8) & 0xFF, f);
+    fputc((in >> 16) & 0xFF, f);
+    fputc((in >> 24) & 0xFF, f);
+}
+
+/* See the description of the format in imf2mid.c */
+static int writeBinary(const char *path)
+{
+    size_t i;
+    FILE  *f;
+
+    f = fopen(path, "wb");
+    if(!f)
+    {
+        fprintf(stderr, "Can't open %s for write!\n", path);
+        return 0;
+    }
+
+    fwrite("I2MT", 1, 4, f);
+    writeLE16(f, 1);
+    writeLE16(f, FP_SIZE);
+    writeLE32(f, (uint32_t)g_count);
+
+    for(i = 0; i < g_count; i++)
+        fwrite(g_entries[i].key, 1, FP_SIZE, f);
+
+    for(i = 0; i < g_count; i++)
+        fputc(g_entries[i].patch & 0xFF, f);
+
+    if(ferror(f))
+    {
+        fprintf(stderr, "Failed to write %s!\n", path);
+        fclose(f);
+        return 0;
+    }
+
+    fclose(f);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    int binary = 0;
+
+    if((argc > 1) && (strcmp(argv[1], "-b") == 0))
+    {
+        binary = 1;
+        argv++;
+        argc--;
+    }
+
+    if(argc < 3)
+    {
+        printf("Usage:\n"
+               "    regconv regtable.txt regtable.h\n"
+               "    regconv -b regtable.txt regtable.bin\n\n"
+               "Converts the instrument detection table into a C header which\n"
+               "gets built into IMF2MID as the default instrument table,\n"
+               "or into the binary instrument database with the -b option.\n\n");
+        return 1;
+    }
+
+    if(!loadTable(argv[1]))
+        return 1;
+
+    if(binary ? !writeBinary(argv[2]) : !writeHeader(argv[2], argv[1]))
+        return 1;
+
+    printf("%lu instruments written into %s\n", (unsigned long)g_count, argv[2]);
+    return 0;
+}